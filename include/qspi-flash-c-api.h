@@ -111,6 +111,18 @@ extern "C"
   qspi_result_t
   qspi_erase_chip (qspi_t* qspi_instance);
 
+  qspi_result_t
+  qspi_erase_range (qspi_t* qspi_instance, uint32_t address, size_t length);
+
+  qspi_result_t
+  qspi_start_erase (qspi_t* qspi_instance, uint32_t address, uint8_t kind);
+
+  qspi_result_t
+  qspi_erase_status (qspi_t* qspi_instance);
+
+  qspi_result_t
+  qspi_wait_erase (qspi_t* qspi_instance, uint32_t timeout);
+
   qspi_result_t
   qspi_reset_chip (qspi_t* qspi_instance);
 
@@ -0,0 +1,122 @@
+/*
+ * qspi-flash-traits.h
+ *
+ * Copyright (c) 2026 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Created on: 16 Oct 2026 (LNP)
+ */
+
+#ifndef QSPI_FLASH_TRAITS_H_
+#define QSPI_FLASH_TRAITS_H_
+
+#include "qspi-flash.h"
+#include "qspi-descr.h"
+
+#if defined (__cplusplus)
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+
+      /*
+       * Device traits, for the products built with a single known flash
+       * device: the description is known at compile time; the device
+       * tables (qspi-descr.cpp) reference it, it is not repeated there.
+       */
+      struct winbond_w25q128jv
+      {
+        static constexpr uint8_t manufacturer_ID = MANUF_ID_WINBOND;
+        static constexpr const char* manufacturer_name = "Winbond";
+        static constexpr qspi_device_t device =
+          { 0x7018, 4096, "W25Q128JV", 0xF, QSPI_ALTERNATE_BYTES_4_LINES,
+          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, true, true, 0x20, 6,
+          QSPI_DDR_HHC_ANALOG_DELAY, 80000000, 0, { }, ADDRESS_3B,
+          { 400, 3000, 45, 400, 120, 1600, 150, 2000, 40, 200 } };
+
+        static qspi_intern*
+        intern (void);
+      };
+
+      struct micron_mt25ql128aba
+      {
+        static constexpr uint8_t manufacturer_ID = MANUF_ID_MICRON;
+        static constexpr const char* manufacturer_name = "Micron/ST";
+        static constexpr qspi_device_t device =
+          { 0xBA18, 4096, "MT25QL128ABA", 0xFF, QSPI_ALTERNATE_BYTES_4_LINES,
+          QSPI_ALTERNATE_BYTES_8_BITS, 8, 2, true, true, 0x00, 8,
+          QSPI_DDR_HHC_ANALOG_DELAY, 90000000, 0, { }, ADDRESS_3B,
+          { 120, 1800, 50, 400, 100, 1000, 150, 1000, 38, 114 } };
+
+        static qspi_intern*
+        intern (void);
+      };
+
+      /*
+       * QSPI flash driver for a device known at compile time, e.g.
+       * qspi_impl_t<winbond_w25q128jv>: the flash ID is only checked, the
+       * device tables are not searched, the SFDP tables are not read and
+       * the geometry is available as constants. The blank and trim maps
+       * are still allocated on the heap at open.
+       */
+      template<typename Traits>
+        class qspi_impl_t : public qspi_impl
+        {
+        public:
+          qspi_impl_t (QSPI_HandleTypeDef* hqspi, uint8_t* cache = nullptr,
+                       size_t cache_size = 0) :
+              qspi_impl
+                { hqspi, cache, cache_size }
+          {
+            set_device (Traits::manufacturer_ID, Traits::manufacturer_name,
+                        &Traits::device, Traits::intern ());
+          }
+
+          // Geometry of a chip; in dual-flash mode, all sizes are doubled
+          static constexpr size_t sector_size = Traits::device.sector_size;
+          static constexpr size_t capacity = (size_t) 1
+              << (((Traits::device.device_ID & 0xFF) < 0x20) ?
+                  (Traits::device.device_ID & 0xFF) :
+                  (Traits::device.device_ID & 0xFF) - 6);
+          static constexpr size_t sector_count = capacity / sector_size;
+
+          static_assert (Traits::device.device_ID != 0, "no device ID");
+          static_assert (sector_size == 4096, "4K sectors expected");
+          static_assert (Traits::device.dummy_cycles
+                             >= Traits::device.alt_bytes_cycles,
+                         "alt bytes cycles exceed the dummy cycles");
+          static_assert (capacity <= 0x1000000
+                             || Traits::device.address_mode != ADDRESS_3B,
+                         "devices above 16 MB need 4 bytes addresses");
+        };
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
+
+#endif
+
+#endif /* QSPI_FLASH_TRAITS_H_ */
@@ -49,7 +49,8 @@ namespace os
       class qspi_impl : public os::posix::block_device_impl
       {
       public:
-        qspi_impl (QSPI_HandleTypeDef* hqspi);
+        qspi_impl (QSPI_HandleTypeDef* hqspi, uint8_t* cache = nullptr,
+                   size_t cache_size = 0);
 
         ~qspi_impl ();
 
@@ -62,6 +63,23 @@ namespace os
           type_not_found = 10,        // qspi specific errors
         } qspi_result_t;
 
+        // Erase kinds (the values are the erase commands)
+        typedef enum
+        {
+          erase_kind_sector = 0x20,
+          erase_kind_block32K = 0x52,
+          erase_kind_block64K = 0xD8,
+          erase_kind_chip = 0xC7,
+        } erase_kind_t;
+
+        // ioctl() requests
+        typedef enum
+        {
+          ioctl_trim = 4,         // same as CTRL_TRIM of ChaN FatFs
+          ioctl_pre_erase = 0x40, // background erase of trimmed sectors
+          ioctl_transfer_thresholds = 0x43, // {polling max, IT max} bytes
+        } ioctl_request_t;
+
         virtual bool
         do_is_opened (void) override;
 
@@ -104,6 +122,37 @@ namespace os
         qspi_result_t
         exit_mem_mapped (void);
 
+        void
+        set_mapped_reads (bool state);
+
+        void
+        set_continuous_read (bool state);
+
+        qspi_result_t
+        set_mapped_cacheable (uint8_t region);
+
+        void
+        set_ddr_reads (bool state);
+
+        void
+        set_direct_commands (bool state);
+
+        void
+        get_transfer_thresholds (uint32_t& polling_max, uint32_t& it_max);
+
+        bool
+        is_ddr (void);
+
+        void
+        set_read_ahead (uint8_t* buff, size_t size);
+
+        void
+        get_read_ahead_stats (uint32_t& hits, uint32_t& misses);
+
+        void
+        get_dma_stats (uint32_t& uncached, uint32_t& maintained,
+                       uint32_t& bounced);
+
         qspi_result_t
         read (uint32_t address, uint8_t* buff, size_t count);
 
@@ -128,6 +177,21 @@ namespace os
         qspi_result_t
         erase_chip (void);
 
+        qspi_result_t
+        erase_range (uint32_t address, size_t length);
+
+        qspi_result_t
+        start_erase (uint32_t address, erase_kind_t kind);
+
+        qspi_result_t
+        erase_status (void);
+
+        qspi_result_t
+        wait_erase (os::rtos::clock::duration_t timeout);
+
+        qspi_result_t
+        write_during_erase (uint32_t address, uint8_t* buff, size_t count);
+
         qspi_result_t
         reset_chip (void);
 
@@ -146,10 +210,18 @@ namespace os
         void
         cb_event (void);
 
+        static void*
+        pre_erase_thread (void* args);
+
         friend class qspi_winbond;
         friend class qspi_micron;
+        friend class qspi_generic;
 
       protected:
+        void
+        set_device (uint8_t manufacturer_ID, const char* manufacturer,
+                    const qspi_device_t* device, qspi_intern* intern);
+
         qspi_result_t
         enter_quad_mode (void);
 
@@ -157,6 +229,15 @@ namespace os
         qspi_command (QSPI_HandleTypeDef* hq, QSPI_CommandTypeDef* cmd,
                       uint32_t timeout);
 
+        qspi_result_t
+        read_register (uint8_t instruction, uint8_t& value);
+
+        qspi_result_t
+        transmit_register (uint8_t value);
+
+        uint32_t
+        page_size (void);
+
         // Standard command sub-set (common for all flash chips)
         static constexpr uint8_t JEDEC_ID = 0x9F;
 
@@ -171,6 +252,29 @@ namespace os
         static constexpr uint8_t BLOCK_64K_ERASE = 0xD8;
         static constexpr uint8_t CHIP_ERASE = 0xC7;
 
+        // 4 bytes address instructions and mode
+        static constexpr uint8_t SECTOR_ERASE_4B = 0x21;
+        static constexpr uint8_t BLOCK_32K_ERASE_4B = 0x5C;
+        static constexpr uint8_t BLOCK_64K_ERASE_4B = 0xDC;
+        static constexpr uint8_t PAGE_PROGRAM_4B = 0x12;
+        static constexpr uint8_t FAST_READ_QUAD_IN_OUT_4B = 0xEC;
+        static constexpr uint8_t FAST_READ_QUAD_IN_OUT_DTR_4B = 0xEE;
+        static constexpr uint8_t ENTER_4B_ADDRESS_MODE = 0xB7;
+        static constexpr uint32_t ADDRESS_3B_LIMIT = 0x1000000;
+
+        static constexpr uint32_t PAGE_SIZE = 256;
+        static constexpr uint32_t COMPARE_PAGES = 32;
+        static constexpr uint32_t BLOCK_32K_SIZE = 32 * 1024;
+        static constexpr uint32_t BLOCK_64K_SIZE = 64 * 1024;
+        static constexpr uint32_t WINDOW_INVALIDATE_MAX = 64 * 1024;
+        // DMA transfers are limited to 65535 items, keep chunks page aligned
+        static constexpr uint32_t DMA_MAX_CHUNK = 0xFFFF & ~(PAGE_SIZE - 1);
+        static constexpr uint32_t CACHE_LINE = 32;
+        static constexpr uint32_t BOUNCE_SIZE = PAGE_SIZE;
+        static constexpr uint32_t CALIBRATE_SMALL = 16;
+        static constexpr uint32_t CALIBRATE_LARGE = PAGE_SIZE;
+        static constexpr uint32_t TRANSFER_LIMIT = 4096;
+
         static constexpr uint8_t RESET_ENABLE = 0x66;
         static constexpr uint8_t RESET_DEVICE = 0x99;
 
@@ -184,6 +288,7 @@ namespace os
         static constexpr uint8_t FAST_READ_DATA = 0x0B;
         static constexpr uint8_t FAST_READ_QUAD_OUT = 0x6B;
         static constexpr uint8_t FAST_READ_QUAD_IN_OUT = 0xEB;
+        static constexpr uint8_t FAST_READ_QUAD_IN_OUT_DTR = 0xED;
 
         // Some timeouts
         static constexpr uint32_t one_ms = 1000
@@ -194,23 +299,233 @@ namespace os
         static constexpr uint32_t ERASE_TIMEOUT = 2 * one_sec;
         static constexpr uint32_t CHIP_ERASE_TIMEOUT = 200 * one_sec;
 
+        // Status polling: default interval (QSPI clocks), polls per typical
+        // operation time
+        static constexpr uint32_t POLL_INTERVAL = 0x10;
+        static constexpr uint32_t POLLS_PER_OPERATION = 16;
+        static constexpr uint32_t PRE_ERASE_POLL = 5 * one_ms;
+        static constexpr uint32_t PRE_ERASE_IDLE = 100 * one_ms;
+
         QSPI_HandleTypeDef* hqspi_;
         os::rtos::semaphore_binary semaphore_
           { "qspi", 0 };
+        os::rtos::semaphore_binary erase_sem_
+          { "qspi_erase", 0 };
 
       private:
+        typedef struct
+        {
+          blknum_t blknum;      // block held by the entry
+          uint32_t stamp;       // last access time, 0 if entry not used
+          bool dirty;           // true if the entry must be written back
+        } cache_entry_t;
+
+        ssize_t
+        write_blocks (const void* buf, blknum_t blknum, std::size_t nblocks);
+
+        cache_entry_t*
+        cache_lookup (blknum_t blknum);
+
+        qspi_result_t
+        cache_write (const uint8_t* buf, blknum_t blknum);
+
+        qspi_result_t
+        cache_flush (cache_entry_t* pce);
+
+        qspi_result_t
+        cache_flush_all (void);
+
+        uint8_t*
+        cache_data (cache_entry_t* pce);
+
+        qspi_result_t
+        compare (uint32_t address, const uint8_t* buff, size_t count,
+                 bool& to_erase, uint32_t& to_program);
+
+        void
+        scan_blank (void);
+
+        bool
+        is_blank (blknum_t blknum, std::size_t nblocks);
+
+        void
+        set_blank (uint32_t address, size_t length, bool state);
+
+        bool
+        is_trimmed (blknum_t blknum, std::size_t nblocks);
+
+        void
+        set_trimmed (blknum_t blknum, std::size_t nblocks, bool state);
+
+        void
+        trim (blknum_t blknum, std::size_t nblocks);
+
+        int
+        pre_erase (void);
+
+        bool
+        unused (blknum_t blknum, std::size_t nblocks);
+
         qspi_result_t
         page_write (uint32_t address, uint8_t* buff, size_t count);
 
+        qspi_result_t
+        write_erased (uint32_t address, uint8_t* buff, size_t count);
+
         qspi_result_t
         read_JEDEC_ID (void);
 
         qspi_result_t
         erase (uint32_t address, uint8_t which);
 
+        void
+        erase_finish (void);
+
+        qspi_result_t
+        start_erase (uint32_t address, erase_kind_t kind, bool deferred);
+
+        qspi_result_t
+        poll_ready (bool wait, uint32_t interval = POLL_INTERVAL);
+
+        void
+        operation_times (uint8_t which, uint32_t& typical, uint32_t& max);
+
+        os::rtos::clock::duration_t
+        operation_timeout (uint8_t which);
+
+        uint32_t
+        poll_interval (uint8_t which);
+
+        void
+        sleep_typical (uint8_t which);
+
+        qspi_result_t
+        suspend_erase (bool& suspended);
+
+        qspi_result_t
+        resume_erase (void);
+
         void
         invalidate_dcache (uint8_t* ptr, size_t len);
 
+        void
+        invalidate_window (uint32_t address, size_t len);
+
+        qspi_result_t
+        read_ahead (void* buf, blknum_t blknum, std::size_t nblocks);
+
+        // Cache maintenance needed by a DMA buffer
+        typedef enum
+        {
+          dma_uncached,         // none (DTCM, non-cacheable, D-cache off)
+          dma_aligned,          // by address, whole cache lines
+          dma_misaligned,       // shares cache lines with other data
+        } dma_buffer_t;
+
+        dma_buffer_t
+        dma_buffer (const uint8_t* buff, size_t count);
+
+        bool
+        mpu_cacheable (uint32_t address);
+
+        bool
+        mpu_uncached (uint32_t start, uint32_t end);
+
+        static bool
+        rasr_cacheable (uint32_t rasr);
+
+        qspi_result_t
+        read_dma (uint32_t address, uint8_t* buff, size_t count);
+
+        qspi_result_t
+        exit_continuous (void);
+
+        void
+        read_command (QSPI_CommandTypeDef& cmd);
+
+        qspi_result_t
+        enter_address_mode (void);
+
+        uint32_t
+        address_size (void);
+
+        void
+        use_device (const char* manufacturer, const qspi_device_t* device,
+                    qspi_intern* intern);
+
+        void
+        release_intern (void);
+
+        qspi_result_t
+        discover_sfdp (void);
+
+        qspi_result_t
+        check_sfdp (void);
+
+        // Operations with pre-computed command descriptors
+        typedef enum
+        {
+          cmd_read = 0,
+          cmd_write_enable,
+          cmd_page_program,
+          cmd_erase_sector,
+          cmd_erase_block32K,
+          cmd_erase_block64K,
+          cmd_erase_chip,
+          cmd_count,
+        } command_id_t;
+
+        // HAL command structure and the matching CCR register image
+        typedef struct
+        {
+          QSPI_CommandTypeDef hal;
+          uint32_t ccr;
+        } command_descr_t;
+
+        void
+        build_commands (void);
+
+        qspi_result_t
+        issue_command (command_id_t id, uint32_t address, size_t count);
+
+        qspi_result_t
+        wait_status (uint32_t flag, bool state);
+
+        // Data transfer strategies, chosen by size
+        typedef enum
+        {
+          xfer_polled,          // CPU polls the FIFO
+          xfer_it,              // interrupt driven
+          xfer_dma,             // DMA, with cache maintenance
+        } transfer_t;
+
+        transfer_t
+        transfer_mode (size_t count);
+
+        qspi_result_t
+        receive (uint8_t* buff, size_t count, transfer_t mode);
+
+        qspi_result_t
+        transmit (uint8_t* buff, size_t count);
+
+        void
+        calibrate_transfers (void);
+
+        uint8_t
+        read_dummy_cycles (void);
+
+        qspi_result_t
+        read_bounced (uint32_t address, uint8_t* buff, size_t count);
+
+        qspi_result_t
+        read_chunk (void);
+
+        uint32_t
+        transfer_timeout (size_t count);
+
+        void
+        read_ahead_drop (uint32_t address, size_t length);
+
         void
         clean_dcache (uint8_t* ptr, size_t len);
 
@@ -223,15 +538,82 @@ namespace os
         uint16_t memory_type_ = 0;
         const char* pmanufacturer_ = nullptr;
         const qspi_device_t* pdevice_ = nullptr;
+        size_t capacity_ = 0;                  // flash size in bytes
+        uint8_t chips_ = 1;                    // 2 in dual-flash mode
+        bool discovered_ = false;              // device described by SFDP
+        // Device given at compile time (qspi_impl_t), if any
+        uint8_t fixed_manufacturer_ID_ = 0;
+        const char* fixed_manufacturer_ = nullptr;
+        const qspi_device_t* fixed_device_ = nullptr;
+        qspi_intern* fixed_intern_ = nullptr;
+        bool address_4B_ = false;              // 4 bytes addresses in use
         bool volatile is_opened_ = false;
-        uint8_t lbuff_[256];
+        bool volatile mapped_ = false;         // memory mapped mode active
+        bool mapped_reads_ = true;             // block reads via the window
+        bool sleeping_ = false;                // in deep power down
+        bool continuous_reads_ = true;         // mapped mode uses XIP
+        bool volatile continuous_ = false;     // flash in continuous read
+        bool ddr_reads_ = true;                // use DTR reads if possible
+        bool ddr_ = false;                     // DTR reads active
+        bool shift_cleared_ = false;           // sample shifting off for DTR
+        uint32_t sample_shifting_ = 0;         // board's sample shifting
+        bool direct_commands_ = true;          // bypass HAL_QSPI_Command
+        uint32_t clock_hz_ = 0;                // QSPI bus clock
+        command_descr_t commands_[cmd_count];
+
+        // Transfer size thresholds (bytes), calibrated at initialization
+        uint32_t polling_max_ = 32;
+        uint32_t it_max_ = PAGE_SIZE;
+
+        // Read transfer in progress, split in DMA sized chunks
+        uint32_t xfer_address_ = 0;
+        uint8_t* xfer_buff_ = nullptr;
+        size_t xfer_left_ = 0;
+
+        // DMA buffer handling: bounce buffer (aligned at run time) and
+        // counters of the paths taken
+        uint8_t bounce_buff_[BOUNCE_SIZE + CACHE_LINE];
+        uint32_t dma_uncached_ = 0;
+        uint32_t dma_maintained_ = 0;
+        uint32_t dma_bounced_ = 0;
+
+        // Read-ahead window for the sequential block reads
+        uint8_t* ra_buff_ = nullptr;
+        size_t ra_size_ = 0;
+        blknum_t ra_start_ = 0;       // first block in the window
+        size_t ra_count_ = 0;         // blocks in the window, 0 if empty
+        blknum_t ra_next_ = 0;        // block expected for a sequential read
+        uint32_t ra_hits_ = 0;
+        uint32_t ra_misses_ = 0;
+        bool volatile erase_busy_ = false;     // erase in progress
+        bool volatile erase_polling_ = false;  // waiting for the erase end
+        bool volatile erase_done_ = false;     // erase end seen
+        bool volatile erase_deferred_ = false; // polling not armed yet
+        bool erase_suspended_ = false;         // programs allowed
+        uint32_t erase_address_ = 0;           // erase in progress
+        uint8_t erase_which_ = 0;
+        uint8_t lbuff_[2 * PAGE_SIZE];        // a page of both chips
+
+        // Write-back cache of erase sectors
+        static constexpr std::size_t CACHE_MAX_SECTORS = 16;
+        uint8_t* cache_buff_;
+        std::size_t cache_size_;
+        std::size_t cache_entries_ = 0;
+        uint32_t cache_clock_ = 0;
+        cache_entry_t cache_[CACHE_MAX_SECTORS];
+
+        // One bit per sector, set if the sector is known to be erased
+        uint32_t* blank_map_ = nullptr;
+        // One bit per block, set if the block was discarded (trimmed)
+        uint32_t* trim_map_ = nullptr;
 
       };
 
       class qspi_intern
       {
       public:
-        qspi_intern (void)
+        qspi_intern (uint8_t suspend, uint8_t resume) :
+            suspend_command (suspend), resume_command (resume)
         {
         }
 
@@ -241,6 +623,13 @@ namespace os
         virtual qspi_impl::qspi_result_t
         enter_quad_mode (qspi_impl* pq) = 0;
 
+        virtual qspi_impl::qspi_result_t
+        is_suspended (qspi_impl* pq, bool& suspended) = 0;
+
+        // Erase/program suspend and resume commands
+        const uint8_t suspend_command;
+        const uint8_t resume_command;
+
       };
 
       inline void
@@ -255,13 +644,120 @@ namespace os
       inline qspi_impl::qspi_result_t
       qspi_impl::enter_quad_mode (void)
       {
-        return (pimpl == nullptr) ? error : pimpl->enter_quad_mode (this);
+        qspi_result_t result =
+            (pimpl == nullptr) ? error : pimpl->enter_quad_mode (this);
+        return (result == ok) ? enter_address_mode () : result;
+      }
+
+      inline uint32_t
+      qspi_impl::page_size (void)
+      {
+        return PAGE_SIZE * chips_;
+      }
+
+      inline uint32_t
+      qspi_impl::address_size (void)
+      {
+        return address_4B_ ? QSPI_ADDRESS_32_BITS : QSPI_ADDRESS_24_BITS;
       }
 
       inline qspi_impl::qspi_result_t
       qspi_impl::exit_mem_mapped (void)
       {
-        return ((qspi_impl::qspi_result_t) (HAL_QSPI_Abort (hqspi_)));
+        if (!mapped_)
+          {
+            return ok;
+          }
+        mapped_ = false;
+        qspi_impl::qspi_result_t result =
+            (qspi_impl::qspi_result_t) HAL_QSPI_Abort (hqspi_);
+
+        // The flash expects no instruction in continuous read mode
+        if (result == ok && continuous_)
+          {
+            result = exit_continuous ();
+          }
+        return result;
+      }
+
+      inline void
+      qspi_impl::set_mapped_reads (bool state)
+      {
+        mapped_reads_ = state;
+      }
+
+      inline void
+      qspi_impl::set_continuous_read (bool state)
+      {
+        continuous_reads_ = state;
+      }
+
+      /*
+       * The frequent commands (reads, programs, erases) are issued by
+       * writing the QUADSPI registers directly; with false they go through
+       * HAL_QSPI_Command() (e.g. to compare the overhead).
+       */
+      inline void
+      qspi_impl::set_direct_commands (bool state)
+      {
+        direct_commands_ = state;
+      }
+
+      inline void
+      qspi_impl::get_transfer_thresholds (uint32_t& polling_max,
+                                          uint32_t& it_max)
+      {
+        polling_max = polling_max_;
+        it_max = it_max_;
+      }
+
+      inline qspi_impl::transfer_t
+      qspi_impl::transfer_mode (size_t count)
+      {
+        return (count <= polling_max_) ? xfer_polled :
+               (count <= it_max_) ? xfer_it : xfer_dma;
+      }
+
+      /*
+       * The DTR reads are selected when the flash is initialized (they need
+       * other dummy cycles), therefore the setting takes effect at the next
+       * open().
+       */
+      inline void
+      qspi_impl::set_ddr_reads (bool state)
+      {
+        ddr_reads_ = state;
+      }
+
+      inline bool
+      qspi_impl::is_ddr (void)
+      {
+        return ddr_;
+      }
+
+      inline void
+      qspi_impl::get_read_ahead_stats (uint32_t& hits, uint32_t& misses)
+      {
+        hits = ra_hits_;
+        misses = ra_misses_;
+      }
+
+      inline void
+      qspi_impl::invalidate_window (uint32_t address, size_t len)
+      {
+        if ((SCB->CCR & (uint32_t) SCB_CCR_DC_Msk)
+            && mpu_cacheable (QSPI_BASE + address))
+          {
+            if (len > WINDOW_INVALIDATE_MAX)
+              {
+                // cheaper than walking the range by address
+                SCB_CleanInvalidateDCache ();
+              }
+            else
+              {
+                invalidate_dcache ((uint8_t*) (QSPI_BASE + address), len);
+              }
+          }
       }
 
       inline qspi_impl::qspi_result_t
@@ -282,21 +778,33 @@ namespace os
         return erase (0, CHIP_ERASE);
       }
 
+      inline uint8_t*
+      qspi_impl::cache_data (cache_entry_t* pce)
+      {
+        return cache_buff_ + (pce - cache_) * block_logical_size_bytes_;
+      }
+
       inline const char*
       qspi_impl::get_manufacturer (void)
       {
         return pmanufacturer_;
       }
 
+      /*
+       * Cache maintenance by address covers all the cache lines touched by
+       * [ptr, ptr + len). Invalidation discards the whole lines, so it must
+       * be used only on line aligned buffers (or on the read only window).
+       */
       inline void
       qspi_impl::invalidate_dcache (uint8_t* ptr, size_t len)
       {
         if (SCB->CCR & (uint32_t) SCB_CCR_DC_Msk)
           {
             // D-cache is enabled
-            uint32_t* aligned_buff = (uint32_t*) (((uint32_t) ptr) & 0xFFFFFFE0);
-            uint32_t aligned_count = (uint32_t) (len & 0xFFFFFFE0) + 32;
-            SCB_CleanInvalidateDCache_by_Addr (aligned_buff, aligned_count);
+            uint32_t start = ((uint32_t) ptr) & ~(CACHE_LINE - 1);
+            uint32_t end = ((uint32_t) ptr + len + CACHE_LINE - 1)
+                & ~(CACHE_LINE - 1);
+            SCB_InvalidateDCache_by_Addr ((uint32_t*) start, end - start);
           }
       }
 
@@ -306,10 +814,10 @@ namespace os
         if (SCB->CCR & (uint32_t) SCB_CCR_DC_Msk)
           {
             // D-cache is enabled
-            uint32_t* aligned_buff = (uint32_t*) (((uint32_t) (ptr))
-                & 0xFFFFFFE0);
-            uint32_t aligned_count = (uint32_t) (len & 0xFFFFFFE0) + 32;
-            SCB_CleanDCache_by_Addr (aligned_buff, aligned_count);
+            uint32_t start = ((uint32_t) ptr) & ~(CACHE_LINE - 1);
+            uint32_t end = ((uint32_t) ptr + len + CACHE_LINE - 1)
+                & ~(CACHE_LINE - 1);
+            SCB_CleanDCache_by_Addr ((uint32_t*) start, end - start);
           }
       }
 
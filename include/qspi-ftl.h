@@ -0,0 +1,182 @@
+/*
+ * qspi-ftl.h
+ *
+ * Copyright (c) 2026 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Created on: 16 Oct 2026 (LNP)
+ */
+
+#ifndef QSPI_FTL_H_
+#define QSPI_FTL_H_
+
+#include "qspi-flash.h"
+
+#if defined (__cplusplus)
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+      /*
+       * Wear-leveling flash translation layer. Logical blocks of 512 bytes
+       * are written out-of-place, in the next free slot of a pre-erased
+       * sector; a RAM table maps logical blocks to slots. The first slot of
+       * each sector holds a header, with the logical block number of each
+       * of the other slots, so that the table can be rebuilt at open.
+       */
+      class qspi_ftl : public os::posix::block_device_impl
+      {
+      public:
+        qspi_ftl (qspi_impl& flash, std::size_t reserve = 8);
+
+        ~qspi_ftl ();
+
+        // Garbage collection policies
+        typedef enum
+        {
+          gc_greedy = 0,        // victim with the fewest valid blocks
+          gc_cost_benefit,      // also favor sectors with old (cold) data
+        } gc_policy_t;
+
+        // ioctl() requests (ioctl_trim as for qspi_impl)
+        typedef enum
+        {
+          ioctl_gc = 0x41,          // one step of garbage collection
+          ioctl_gc_policy = 0x42,   // set the policy, arg: gc_policy_t
+        } ioctl_request_t;
+
+        virtual bool
+        do_is_opened (void) override;
+
+        virtual int
+        do_vopen (const char* path, int oflag, std::va_list args) override;
+
+        virtual ssize_t
+        do_read_block (void* buf, blknum_t blknum, std::size_t nblocks)
+            override;
+
+        virtual ssize_t
+        do_write_block (const void* buf, blknum_t blknum, std::size_t nblocks)
+            override;
+
+        virtual int
+        do_vioctl (int request, std::va_list args) override;
+
+        virtual void
+        do_sync (void) override;
+
+        virtual int
+        do_close (void) override;
+
+        static void*
+        gc_thread (void* args);
+
+      private:
+        static constexpr uint32_t MAGIC = 0x4C544651;     // "QFTL"
+        static constexpr size_t BLOCK_SIZE = 512;
+        static constexpr size_t SECTOR_SIZE = 4096;
+        static constexpr size_t SLOTS = SECTOR_SIZE / BLOCK_SIZE;
+        static constexpr uint16_t UNMAPPED = 0xFFFF;
+        static constexpr uint32_t NO_SECTOR = 0xFFFFFFFF;
+        static constexpr uint8_t ERASED = 0xFF;   // valid_ of erased sectors
+        static constexpr size_t GC_FREE_TARGET = 2;
+
+        static constexpr uint32_t one_ms = 1000
+            / os::rtos::sysclock.frequency_hz;
+        static constexpr uint32_t ERASE_TIMEOUT = 2000 * one_ms;
+        static constexpr uint32_t GC_POLL = 5 * one_ms;
+        static constexpr uint32_t GC_IDLE = 100 * one_ms;
+
+        // Sector header, at the start of slot 0
+        typedef struct
+        {
+          uint32_t magic;
+          uint32_t seq;         // allocation order, 0xFFFFFFFF if free
+          uint32_t erases;      // erase count
+          uint16_t lba[SLOTS - 1];      // logical block of each data slot
+        } header_t;
+
+        qspi_impl::qspi_result_t
+        mount (void);
+
+        qspi_impl::qspi_result_t
+        write_slot (blknum_t blknum, const uint8_t* data);
+
+        qspi_impl::qspi_result_t
+        program (uint32_t address, uint8_t* data, size_t count);
+
+        qspi_impl::qspi_result_t
+        allocate (void);
+
+        qspi_impl::qspi_result_t
+        collect (void);
+
+        qspi_impl::qspi_result_t
+        relocate (uint32_t sector);
+
+        qspi_impl::qspi_result_t
+        finish_erase (bool wait);
+
+        uint32_t
+        select_victim (void);
+
+        uint32_t
+        free_sector (bool erased);
+
+        size_t
+        erased_count (void);
+
+        void
+        unmap (blknum_t blknum);
+
+        int
+        gc_step (void);
+
+        qspi_impl& flash_;
+        std::size_t reserve_;
+        bool volatile is_opened_ = false;
+        gc_policy_t policy_ = gc_cost_benefit;
+
+        uint32_t sectors_ = 0;          // sectors used by the FTL
+        uint16_t* map_ = nullptr;       // logical block -> slot
+        uint32_t* seq_ = nullptr;       // per sector, 0 if free
+        uint32_t* erases_ = nullptr;    // per sector erase count
+        uint8_t* valid_ = nullptr;      // per sector valid slots, or ERASED
+        uint32_t seq_counter_ = 0;
+        uint32_t active_ = NO_SECTOR;   // sector receiving the writes
+        size_t next_slot_ = SLOTS;
+        uint32_t erasing_ = NO_SECTOR;  // sector being erased
+        bool relocating_ = false;
+        uint8_t buff_[BLOCK_SIZE];
+      };
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
+
+#endif // (__cplusplus)
+
+#endif /* QSPI_FTL_H_ */
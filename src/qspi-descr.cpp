@@ -30,6 +30,7 @@
 #include "qspi-descr.h"
 #include "qspi-micron.h"
 #include "qspi-winbond.h"
+#include "qspi-flash-traits.h"
 
 namespace os
 {
@@ -38,32 +39,66 @@ namespace os
     namespace stm32f7
     {
 
-      // Micron devices; accepted dummy cycles can be between 1 and 14
+      // Micron devices; accepted dummy cycles can be between 1 and 14 (the
+      // same setting is used by the SDR and the DTR reads);
+      // the alt bytes carry the XIP confirmation bit (DQ0 of the first
+      // dummy cycle), 1 for a normal read, 0 to stay in XIP mode;
+      // the devices above 16 MB use the 4 bytes address instructions
+      // (entering the 4 bytes address mode requires a write enable)
       const qspi_device_t micron_devices[] =
         {
-          { 0xBA18, 4096, "MT25QL128ABA", 0, QSPI_ALTERNATE_BYTES_NONE,
-          QSPI_ALTERNATE_BYTES_8_BITS, 8, 0, true },
+          micron_mt25ql128aba::device, // see qspi-flash-traits.h
 
-          { 0xBB18, 4096, "MT25QL128ABA", 0, QSPI_ALTERNATE_BYTES_NONE,
-          QSPI_ALTERNATE_BYTES_8_BITS, 8, 0, true },
+          { 0xBB18, 4096, "MT25QL128ABA", 0xFF, QSPI_ALTERNATE_BYTES_4_LINES,
+          QSPI_ALTERNATE_BYTES_8_BITS, 8, 2, true, true, 0x00, 8,
+          QSPI_DDR_HHC_ANALOG_DELAY, 90000000, 0, { }, ADDRESS_3B,
+          { 120, 1800, 50, 400, 100, 1000, 150, 1000, 38, 114 } },
+
+          { 0xBA19, 4096, "MT25QL256ABA", 0xFF, QSPI_ALTERNATE_BYTES_4_LINES,
+          QSPI_ALTERNATE_BYTES_8_BITS, 8, 2, true, true, 0x00, 8,
+          QSPI_DDR_HHC_ANALOG_DELAY, 90000000, 0, { }, ADDRESS_4B_OPCODES,
+          { 120, 1800, 50, 400, 100, 1000, 150, 1000, 76, 229 } },
+
+          { 0xBA20, 4096, "MT25QL512ABB", 0xFF, QSPI_ALTERNATE_BYTES_4_LINES,
+          QSPI_ALTERNATE_BYTES_8_BITS, 8, 2, true, true, 0x00, 8,
+          QSPI_DDR_HHC_ANALOG_DELAY, 90000000, 0, { }, ADDRESS_4B_OPCODES,
+          { 120, 1800, 50, 400, 100, 1000, 150, 1000, 153, 460 } },
 
           { } //
         };
 
-      // Winbond devices; accepted dummy cycles can be either 2, 4, 6 or 8
+      // Winbond devices; accepted dummy cycles can be either 2, 4, 6 or 8;
+      // the continuous read mode is kept while the mode bits M5-4 are 10b;
+      // the DTR reads use the same read parameters as the SDR ones;
+      // the devices above 16 MB are switched to 4 bytes address mode
       const qspi_device_t winbond_devices[] =
         {
           { 0x6016, 4096, "W25Q32FV", 0xF, QSPI_ALTERNATE_BYTES_4_LINES,
-          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false },
+          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false, true, 0x20, 0,
+          QSPI_DDR_HHC_ANALOG_DELAY, 0, 0, { }, ADDRESS_3B,
+          { 700, 3000, 45, 400, 120, 1600, 150, 2000, 10, 50 } },
 
           { 0x6017, 4096, "W25Q64FV", 0xF, QSPI_ALTERNATE_BYTES_4_LINES,
-          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false },
+          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false, true, 0x20, 0,
+          QSPI_DDR_HHC_ANALOG_DELAY, 0, 0, { }, ADDRESS_3B,
+          { 700, 3000, 45, 400, 120, 1600, 150, 2000, 20, 100 } },
             
           { 0x6018, 4096, "W25Q128FV", 0xF, QSPI_ALTERNATE_BYTES_4_LINES,
-          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false },
+          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false, true, 0x20, 0,
+          QSPI_DDR_HHC_ANALOG_DELAY, 0, 0, { }, ADDRESS_3B,
+          { 700, 3000, 45, 400, 120, 1600, 150, 2000, 40, 200 } },
+
+          winbond_w25q128jv::device, // see qspi-flash-traits.h
 
-          { 0x7018, 4096, "W25Q128JV", 0xF, QSPI_ALTERNATE_BYTES_4_LINES,
-          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, true },
+          { 0x6019, 4096, "W25Q256FV", 0xF, QSPI_ALTERNATE_BYTES_4_LINES,
+          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false, true, 0x20, 0,
+          QSPI_DDR_HHC_ANALOG_DELAY, 0, 0, { }, ADDRESS_4B_MODE,
+          { 700, 3000, 50, 400, 120, 1600, 150, 2000, 80, 400 } },
+
+          { 0x7019, 4096, "W25Q256JV", 0xF, QSPI_ALTERNATE_BYTES_4_LINES,
+          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false, true, 0x20, 0,
+          QSPI_DDR_HHC_ANALOG_DELAY, 0, 0, { }, ADDRESS_4B_MODE,
+          { 700, 3000, 50, 400, 120, 1600, 150, 2000, 80, 400 } },
 
           { } //
         };
@@ -83,6 +118,27 @@ namespace os
           { };
       }
 
+      // Devices known at compile time
+      constexpr const char* winbond_w25q128jv::manufacturer_name;
+      constexpr qspi_device_t winbond_w25q128jv::device;
+
+      qspi_intern*
+      winbond_w25q128jv::intern (void)
+      {
+        static qspi_winbond winbond;
+        return &winbond;
+      }
+
+      constexpr const char* micron_mt25ql128aba::manufacturer_name;
+      constexpr qspi_device_t micron_mt25ql128aba::device;
+
+      qspi_intern*
+      micron_mt25ql128aba::intern (void)
+      {
+        static qspi_micron micron;
+        return &micron;
+      }
+
       // Supported manufactures
       const qspi_manuf_t qspi_manufacturers[] =
         {
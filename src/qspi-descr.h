@@ -42,6 +42,27 @@ namespace os
 #define MANUF_ID_MICRON 0x20
 #define MANUF_ID_WINBOND 0xEF
 
+      // Addressing of the devices larger than 16 MB
+#define ADDRESS_3B 0            // 3 bytes addresses only
+#define ADDRESS_4B_OPCODES 1    // 4 bytes address instructions
+#define ADDRESS_4B_MODE 2       // enter the 4 bytes address mode (0xB7)
+
+      // Typical and maximum times of the program and erase operations,
+      // from the datasheet; zero selects the driver's default timeouts
+      typedef struct qspi_timing_s
+      {
+        uint16_t program_typ;     // page program (us)
+        uint16_t program_max;
+        uint16_t erase_4K_typ;    // 4K sector erase (ms)
+        uint16_t erase_4K_max;
+        uint16_t erase_32K_typ;   // 32K block erase (ms)
+        uint16_t erase_32K_max;
+        uint16_t erase_64K_typ;   // 64K block erase (ms)
+        uint16_t erase_64K_max;
+        uint16_t chip_erase_typ;  // chip erase (s)
+        uint16_t chip_erase_max;
+      } qspi_timing_t;
+
       typedef struct qspi_device_s
       {
         uint16_t device_ID;
@@ -54,7 +75,16 @@ namespace os
         uint32_t alt_bytes_size;  // 8, 16 or 32 bits
         uint8_t dummy_cycles;     // dummy cycles
         uint8_t alt_bytes_cycles; // alt bytes cycles to subtract from dummy cycles
-        bool DDR_support;         // dual data rate (not used for now)
+        bool DDR_support;         // dual data rate (DTR) reads
+        bool continuous_support;  // continuous read (XIP) mode available
+        uint8_t continuous_alt;   // alt bytes that keep the continuous mode
+        uint8_t ddr_dummy_cycles; // dummy cycles in DTR mode
+        uint32_t ddr_hold;        // DdrHoldHalfCycle setting in DTR mode
+        uint32_t ddr_max_clock;   // max. DTR read clock (Hz)
+        uint8_t read_instruction; // quad I/O fast read, 0 for the standard
+        uint8_t erase_instructions[3]; // 4K, 32K, 64K erases, 0 for the standard
+        uint8_t address_mode;     // ADDRESS_3B, ADDRESS_4B_OPCODES or _MODE
+        qspi_timing_t timing;     // program and erase times
       } qspi_device_t;
 
       typedef struct qspi_manuf_s
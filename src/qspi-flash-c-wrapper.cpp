@@ -247,6 +247,59 @@ qspi_erase_chip (qspi_t* qspi_instance)
   return (qspi_result_t) (((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).erase_chip ());
 }
 
+/**
+ * @brief  Erase a range using the largest possible erase commands.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @param  address: start address of the range (sector aligned).
+ * @param  length: length of the range in bytes (multiple of the sector size).
+ * @return qspi_ok if successful, or a qspi error otherwise.
+ */
+qspi_result_t
+qspi_erase_range (qspi_t* qspi_instance, uint32_t address, size_t length)
+{
+  return (qspi_result_t) (((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).erase_range (
+      address, length));
+}
+
+/**
+ * @brief  Start an erase and return without waiting for its end.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @param  address: address in the sector/block to be erased.
+ * @param  kind: erase command: 0x20 (sector), 0x52 (32K block),
+ *    0xD8 (64K block) or 0xC7 (chip).
+ * @return qspi_ok if the erase was started, or a qspi error otherwise.
+ */
+qspi_result_t
+qspi_start_erase (qspi_t* qspi_instance, uint32_t address, uint8_t kind)
+{
+  return (qspi_result_t) (((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).start_erase (
+      address, (qspi_impl::erase_kind_t) kind));
+}
+
+/**
+ * @brief  Check if an erase started with qspi_start_erase is finished.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @return qspi_ok if finished, qspi_busy if still in progress.
+ */
+qspi_result_t
+qspi_erase_status (qspi_t* qspi_instance)
+{
+  return (qspi_result_t) (((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).erase_status ());
+}
+
+/**
+ * @brief  Wait for the end of an erase started with qspi_start_erase.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @param  timeout: maximum time to wait, in ticks.
+ * @return qspi_ok if finished, qspi_timeout if still in progress.
+ */
+qspi_result_t
+qspi_wait_erase (qspi_t* qspi_instance, uint32_t timeout)
+{
+  return (qspi_result_t) (((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).wait_erase (
+      timeout));
+}
+
 /**
  * @brief  Software reset the flash chip.
  * @param  qspi_instance: pointer to the qspi object.
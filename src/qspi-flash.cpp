@@ -32,12 +32,15 @@
  * a QSPI flash device.
  */
 
+#include <string.h>
 #include <cmsis-plus/rtos/os.h>
 #include <cmsis-plus/diag/trace.h>
 #include "qspi-flash.h"
 #include "qspi-descr.h"
 #include "qspi-winbond.h"
 #include "qspi-micron.h"
+#include "qspi-generic.h"
+#include "qspi-kernels.h"
 
 namespace os
 {
@@ -48,16 +51,25 @@ namespace os
       /**
        * @brief Constructor.
        * @param hqspi: HAL qspi handle.
+       * @param cache: optional buffer for the write-back sector cache.
+       * @param cache_size: size of the cache buffer in bytes; it is split
+       *    in as many erase sectors as it can hold (at most 16).
        */
-      qspi_impl::qspi_impl (QSPI_HandleTypeDef* hqspi)
+      qspi_impl::qspi_impl (QSPI_HandleTypeDef* hqspi, uint8_t* cache,
+                            size_t cache_size)
       {
         trace::printf ("%s(%p) @%p\n", __func__, hqspi, this);
         hqspi_ = hqspi;
+        cache_buff_ = cache;
+        cache_size_ = (cache == nullptr) ? 0 : cache_size;
       }
 
       qspi_impl::~qspi_impl ()
       {
         trace::printf ("%s(%p) @%p\n", __func__, this);
+        release_intern ();
+        delete[] blank_map_;
+        delete[] trim_map_;
       }
 
 #pragma GCC diagnostic push
@@ -101,6 +113,13 @@ namespace os
                 break;
               }
 
+            // No erase survives a close (or a failed one)
+            erase_busy_ = false;
+            erase_polling_ = false;
+            erase_deferred_ = false;
+            erase_done_ = false;
+            erase_sem_.reset ();
+
             if (qspi_impl::initialize () != qspi_impl::ok)
               {
                 errno = EIO;
@@ -117,6 +136,25 @@ namespace os
                 break;
               }
 
+            // Set-up the write-back cache, if any
+            cache_entries_ = cache_size_ / block_logical_size_bytes_;
+            if (cache_entries_ > CACHE_MAX_SECTORS)
+              {
+                cache_entries_ = CACHE_MAX_SECTORS;
+              }
+            for (size_t i = 0; i < cache_entries_; i++)
+              {
+                cache_[i].stamp = 0;
+                cache_[i].dirty = false;
+              }
+
+            // Find out which sectors are already erased
+            ra_count_ = 0;
+            scan_blank ();
+            delete[] trim_map_;
+            trim_map_ = new uint32_t[(num_blocks_ + 31) / 32]
+              { };
+
             is_opened_ = true;
             result = 0;
           }
@@ -140,17 +178,141 @@ namespace os
         uint32_t address = block_logical_size_bytes_ * blknum;
         size_t count = block_logical_size_bytes_ * nblocks;
 
-        if (qspi_impl::read (address, (uint8_t*) buf, count) != ok)
+        if (is_blank (blknum, nblocks))
+          {
+            // erased blocks, no need to ask the flash
+            memset (buf, 0xFF, count);
+          }
+        else if (mapped_reads_ && !erase_busy_ && !sleeping_
+            && enter_mem_mapped () == ok)
+          {
+            // copy from the memory mapped window, no command needed; the
+            // D-cache is kept coherent by the program and erase functions
+            memcpy (buf, (uint8_t*) (QSPI_BASE + address), count);
+          }
+        else if (read_ahead (buf, blknum, nblocks) != ok)
           {
             errno = EIO;
-            nblocks = -1;
+            return -1;
+          }
+
+        // blocks held in the write-back cache are newer than the flash
+        for (size_t i = 0; i < cache_entries_; i++)
+          {
+            cache_entry_t* pce = &cache_[i];
+            if (pce->stamp != 0 && pce->blknum >= blknum
+                && pce->blknum < blknum + nblocks)
+              {
+                memcpy (
+                    (uint8_t*) buf
+                        + (pce->blknum - blknum) * block_logical_size_bytes_,
+                    cache_data (pce), block_logical_size_bytes_);
+                pce->stamp = ++cache_clock_;
+              }
           }
 
         return nblocks;
       }
 
       /**
-       * @brief Write data to the block device.
+       * @brief Read blocks through the read-ahead buffer, if configured. When
+       *    a read continues the previous one, a whole window of blocks is
+       *    read from the flash with a single command; the following
+       *    sequential reads are served from RAM.
+       * @param buf: buffer where the data will be returned.
+       * @param blknum: the block number.
+       * @param nblocks: number of blocks to read.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::read_ahead (void* buf, posix::block_device::blknum_t blknum,
+                             std::size_t nblocks)
+      {
+        qspi_impl::qspi_result_t result = ok;
+        size_t bsize = block_logical_size_bytes_;
+        size_t window = ra_size_ / bsize;
+        bool sequential = (blknum == ra_next_);
+
+        ra_next_ = blknum + nblocks;
+
+        if (window < 2 || nblocks > window / 2)
+          {
+            // no read-ahead, or large reads that gain nothing from it
+            return read (blknum * bsize, (uint8_t*) buf, nblocks * bsize);
+          }
+
+        if (blknum < ra_start_ || blknum + nblocks > ra_start_ + ra_count_)
+          {
+            ra_misses_++;
+            if (!sequential)
+              {
+                return read (blknum * bsize, (uint8_t*) buf, nblocks * bsize);
+              }
+
+            // sequential access detected, fill the window
+            if (window > num_blocks_ - blknum)
+              {
+                window = num_blocks_ - blknum;
+              }
+            ra_count_ = 0;
+            result = read (blknum * bsize, ra_buff_, window * bsize);
+            if (result != ok)
+              {
+                return result;
+              }
+            ra_start_ = blknum;
+            ra_count_ = window;
+          }
+        else
+          {
+            ra_hits_++;
+          }
+
+        memcpy (buf, ra_buff_ + (blknum - ra_start_) * bsize, nblocks * bsize);
+        return result;
+      }
+
+      /**
+       * @brief  Set the read-ahead buffer, used by the block reads when the
+       *    flash is not read through the memory mapped window.
+       * @param  buff: buffer for the read-ahead window, or nullptr to disable.
+       * @param  size: size of the buffer (a multiple of the sector size; at
+       *    least two sectors).
+       */
+      void
+      qspi_impl::set_read_ahead (uint8_t* buff, size_t size)
+      {
+        ra_buff_ = buff;
+        ra_size_ = (buff == nullptr) ? 0 : size;
+        ra_count_ = 0;
+        ra_hits_ = 0;
+        ra_misses_ = 0;
+      }
+
+      /**
+       * @brief  Drop the read-ahead window if it overlaps a range of the
+       *    flash that was changed.
+       * @param  address: start address of the range.
+       * @param  length: length of the range in bytes.
+       */
+      void
+      qspi_impl::read_ahead_drop (uint32_t address, size_t length)
+      {
+        if (ra_count_ != 0)
+          {
+            uint32_t start = ra_start_ * block_logical_size_bytes_;
+            uint32_t end = start + ra_count_ * block_logical_size_bytes_;
+            if (address < end && address + length > start)
+              {
+                ra_count_ = 0;
+              }
+          }
+      }
+
+      /**
+       * @brief Write data to the block device. If a write-back cache is
+       *    configured, small writes are absorbed by the cache and reach the
+       *    flash only on sync, close or when evicted.
        * @param buf: buffer with the data to be written.
        * @param blknum: the block number.
        * @param nblocks: number of blocks to be written.
@@ -160,103 +322,152 @@ namespace os
       qspi_impl::do_write_block (const void* buf,
                                  posix::block_device::blknum_t blknum,
                                  std::size_t nblocks)
+      {
+        if (nblocks >= cache_entries_)
+          {
+            // no cache or write too large to be cached, drop stale entries
+            for (size_t i = 0; i < cache_entries_; i++)
+              {
+                if (cache_[i].stamp != 0 && cache_[i].blknum >= blknum
+                    && cache_[i].blknum < blknum + nblocks)
+                  {
+                    cache_[i].stamp = 0;
+                    cache_[i].dirty = false;
+                  }
+              }
+            return write_blocks (buf, blknum, nblocks);
+          }
+
+        const uint8_t* p = (const uint8_t*) buf;
+        for (size_t i = 0; i < nblocks; i++)
+          {
+            if (cache_write (p, blknum + i) != ok)
+              {
+                errno = EIO;
+                return -1;
+              }
+            p += block_logical_size_bytes_;
+          }
+
+        return nblocks;
+      }
+
+      /**
+       * @brief Write data straight to the flash, erasing only if needed.
+       * @param buf: buffer with the data to be written.
+       * @param blknum: the block number.
+       * @param nblocks: number of blocks to be written.
+       * @return Number of blocks written or -1 if error.
+       */
+      ssize_t
+      qspi_impl::write_blocks (const void* buf,
+                               posix::block_device::blknum_t blknum,
+                               std::size_t nblocks)
       {
         // compute the block's address and the total bytes to be written
         uint32_t address = block_logical_size_bytes_ * blknum;
         size_t count = block_logical_size_bytes_ * nblocks;
-        bool to_write = false;
+
+        // a background pre-erase must end before touching the flash
+        if (erase_busy_ && wait_erase (operation_timeout (erase_which_)) != ok)
+          {
+            errno = EIO;
+            return -1;
+          }
 
         // check if we really need to write
-        uint8_t* p = (uint8_t*) buf;
-        for (posix::block_device::blknum_t i = 0; i < count; i++)
+        if (qspi_kernels::all_ones ((const uint8_t*) buf, count))
           {
-            if (*p++ != 0xFF)
+            // nothing to write, only erase (if not already erased) then quit
+            if (is_blank (blknum, nblocks) == false
+                && qspi_impl::erase_range (address, count) != ok)
               {
-                to_write = true;
-                break;  // yes, we have data to write
+                errno = EIO;
+                nblocks = -1;
               }
           }
-
-        int i = nblocks;
-        if (to_write == false)
+        else if (is_blank (blknum, nblocks))
+          {
+            // blocks known to be erased, no need to read and compare
+            if (qspi_impl::write_erased (address, (uint8_t*) buf, count) != ok)
+              {
+                errno = EIO;
+                nblocks = -1;
+              }
+          }
+        else if (is_trimmed (blknum, nblocks))
           {
-            // nothing to write, only erase then quit
-            while (i--)
+            // discarded blocks, their content does not matter: erase them
+            // right away, no need to read and compare
+            if (qspi_impl::erase_range (address, count) != ok
+                || qspi_impl::write_erased (address, (uint8_t*) buf, count)
+                    != ok)
               {
-                qspi_impl::erase_sector (blknum++);
+                errno = EIO;
+                nblocks = -1;
               }
           }
         else
           {
-            uint32_t sector_256 = 0;
-            p = (uint8_t*) buf;
+            qspi_impl::qspi_result_t result = ok;
+            uint8_t* pb = (uint8_t*) buf;
             bool to_erase = false;
+            size_t chunk;
+            size_t page_bytes = page_size ();
 
-            do
+            // compare in chunks of up to 32 pages
+            for (size_t done = 0;
+                done < count && to_erase == false && result == ok;
+                done += chunk)
               {
-                bool valid_data = false;
+                uint32_t to_program;
 
-                if (qspi_impl::read (address + (sector_256 * sizeof(lbuff_)),
-                                     lbuff_, sizeof(lbuff_)) != ok)
+                chunk = count - done;
+                if (chunk > COMPARE_PAGES * page_bytes)
                   {
-                    errno = EIO;
-                    nblocks = -1;
-                    break;  // read error, exit
+                    chunk = COMPARE_PAGES * page_bytes;
                   }
 
-                // check if we need to erase before write
-                for (int j = 0; j < (int) sizeof(lbuff_); j++, p++)
-                  {
-                    if (*p != lbuff_[j] && lbuff_[j] != 0xFF)
-                      {
-                        // yes, we must erase before write
-                        to_erase = true;
-                        break;
-                      }
-                    if (*p != 0xFF && *p != lbuff_[j])
-                      {
-                        valid_data = true;
-                      }
-                  }
-                if (to_erase)
-                  {
-                    break;
-                  }
+                result = compare (address + done, pb + done, chunk, to_erase,
+                                  to_program);
 
-                // sector already erased, just write but only if whole data != 0xFF
-                if (valid_data)
+                // no erase needed, just write the pages that changed
+                for (size_t page = done;
+                    result == ok && to_erase == false && to_program != 0;
+                    page += page_bytes, to_program >>= 1)
                   {
-                    if (qspi_impl::write (
-                        address + (sector_256 * sizeof(lbuff_)),
-                        (uint8_t*) buf + (sector_256 * sizeof(lbuff_)),
-                        sizeof(lbuff_)) != ok)
+                    if (to_program & 1)
                       {
-                        errno = EIO;
-                        nblocks = -1;
-                        break;
+                        result = page_write (address + page, pb + page,
+                                             page_bytes);
                       }
                   }
-                sector_256++;
               }
-            while (p < ((uint8_t*) buf + count));
 
-            if (to_erase == true && nblocks > 0)
+            if (to_erase == true && result == ok)
               {
                 // write without erase did not work
                 // so erase first the blocks to be written
-                while (i--)
+                result = qspi_impl::erase_range (address, count);
+                if (result == ok)
                   {
-                    qspi_impl::erase_sector (blknum++);
+                    result = qspi_impl::write_erased (address, pb, count);
                   }
+              }
 
-                if (qspi_impl::write (address, (uint8_t*) buf, count) != ok)
-                  {
-                    errno = EIO;
-                    nblocks = -1;
-                  }
+            if (result != ok)
+              {
+                errno = EIO;
+                nblocks = -1;
               }
           }
 
+        if ((ssize_t) nblocks > 0)
+          {
+            // the blocks hold live data again
+            set_trimmed (blknum, nblocks, false);
+          }
+
         return nblocks;
       }
 
@@ -269,6 +480,51 @@ namespace os
       int
       qspi_impl::do_vioctl (int request, std::va_list args)
       {
+        if (!is_opened_)
+          {
+            errno = EBADF;
+            return -1;
+          }
+
+        switch (request)
+          {
+          case ioctl_trim:
+            {
+              // ChaN FatFs style, range of blocks {first, last} (inclusive)
+              uint32_t* range = va_arg(args, uint32_t*);
+
+              if (range == nullptr || range[0] > range[1]
+                  || range[1] >= num_blocks_)
+                {
+                  errno = EINVAL;
+                  return -1;
+                }
+              trim (range[0], range[1] - range[0] + 1);
+              return 0;
+            }
+
+          case ioctl_pre_erase:
+            return pre_erase ();
+
+          case ioctl_transfer_thresholds:
+            {
+              // {polling max, IT max}, larger transfers use DMA
+              uint32_t* limits = va_arg(args, uint32_t*);
+
+              if (limits == nullptr || limits[0] > limits[1])
+                {
+                  errno = EINVAL;
+                  return -1;
+                }
+              polling_max_ = limits[0];
+              it_max_ = limits[1];
+              return 0;
+            }
+
+          default:
+            break;
+          }
+
         return -1;
       }
 
@@ -278,7 +534,10 @@ namespace os
       void
       qspi_impl::do_sync (void)
       {
-        ;
+        if (cache_flush_all () != ok)
+          {
+            errno = EIO;
+          }
       }
 
       /**
@@ -288,12 +547,20 @@ namespace os
       int
       qspi_impl::do_close (void)
       {
-        if (qspi_impl::uninitialize () != ok)
+        // A background erase (e.g. ioctl_pre_erase) must end before the
+        // chip is reset
+        if (cache_flush_all () != ok
+            || wait_erase (operation_timeout (erase_which_)) != ok
+            || qspi_impl::uninitialize () != ok)
           {
             errno = EIO;
             return -1;
           }
 
+        delete[] blank_map_;
+        blank_map_ = nullptr;
+        delete[] trim_map_;
+        trim_map_ = nullptr;
         is_opened_ = false;
 
         return 0;
@@ -302,297 +569,2164 @@ namespace os
       //------------- End of POSIX interface ---------------------------
 
       /**
-       * @brief  Read the flash chip ID and initialize the internal structures accordingly.
-       * @return qspi_impl::ok if successful, or a qspi_impl error if the flash could not be identified
-       * 	 or it is not supported by the driver.
+       * @brief  Compare new data with the content of the flash, to decide if
+       *    the area can be written without erase, and which pages must be
+       *    programmed. The flash is read through the memory mapped window,
+       *    which costs a single command for the whole range; the indirect
+       *    reads in page sized chunks are used only as a fall back.
+       * @param  address: start address in flash (page aligned).
+       * @param  buff: new data.
+       * @param  count: amount of data (whole pages, max. COMPARE_PAGES).
+       * @param  to_erase: returns true if the area must be erased first.
+       * @param  to_program: returns a bit mask of the pages to be programmed
+       *    (bit 0 is the first page).
+       * @return qspi::ok if successful, qspi::busy if the flash is in deep
+       *    power-down, a qspi error otherwise.
        */
       qspi_impl::qspi_result_t
-      qspi_impl::initialize (void)
+      qspi_impl::compare (uint32_t address, const uint8_t* buff, size_t count,
+                          bool& to_erase, uint32_t& to_program)
       {
         qspi_impl::qspi_result_t result;
+        uint8_t* pf = (uint8_t*) (QSPI_BASE + address);
+        size_t page_bytes = page_size ();
+        bool mapped;
 
-        // Read flash device ID
-        if ((result = qspi_impl::read_JEDEC_ID ()) != ok)
+        to_erase = false;
+        to_program = 0;
+
+        if (sleeping_)
           {
-            // Flash device might be in deep sleep
-            qspi_impl::sleep (false);
+            // in deep power-down, the flash would read as garbage
+            return busy;
+          }
 
-            // Reset and try reading ID again
-            if ((result = qspi_impl::reset_chip ()) == ok)
+        // the mapped mode is left by the next command
+        result = enter_mem_mapped ();
+        mapped = (result == ok);
+
+        for (size_t page = 0; page < count / page_bytes && to_erase == false;
+            page++, buff += page_bytes)
+          {
+            if (mapped == false)
               {
-                result = qspi_impl::read_JEDEC_ID ();
+                pf = lbuff_;
+                result = read (address + page * page_bytes, lbuff_,
+                               page_bytes);
+                if (result != ok)
+                  {
+                    break;  // read error, exit
+                  }
               }
-          }
 
-        // If all OK, switch flash device in quad mode
-        if (result == ok)
-          result = enter_quad_mode ();
+            // NOR flash can clear any bit without erase, an erase is needed
+            // only if the new data sets a bit that is cleared in flash
+            to_erase = qspi_kernels::needs_erase (pf, buff, page_bytes);
+            if (to_erase == false
+                && qspi_kernels::has_programmable_bits (pf, buff, page_bytes))
+              {
+                to_program |= (1u << page);
+              }
+            pf += page_bytes;
+          }
 
         return result;
       }
 
       /**
-       * @brief  Set flash device to default state.
-       * @return qspi::ok if successful, or a qspi error otherwise.
+       * @brief  Build the map of erased sectors. The flash is scanned through
+       *    the memory mapped window, a sector being dropped at its first
+       *    word that is not 0xFFFFFFFF. If the flash cannot be mapped (or
+       *    is in deep power-down), no sector is considered erased.
        */
-      qspi_impl::qspi_result_t
-      qspi_impl::uninitialize (void)
+      void
+      qspi_impl::scan_blank (void)
       {
-        pimpl = nullptr;
-        qspi_impl::sleep (false);
-        return qspi_impl::reset_chip ();
+        size_t sectors = get_sector_count ();
+        size_t sector_size = get_sector_size ();
+
+        delete[] blank_map_;
+        blank_map_ = new uint32_t[(sectors + 31) / 32]
+          { };
+
+        if (!sleeping_ && enter_mem_mapped () == ok)
+          {
+            for (size_t sector = 0; sector < sectors; sector++)
+              {
+                uint8_t* p = (uint8_t*) (QSPI_BASE + sector * sector_size);
+
+                invalidate_dcache (p, sector_size);
+                if (qspi_kernels::all_ones (p, sector_size))
+                  {
+                    blank_map_[sector / 32] |= (1u << (sector % 32));
+                  }
+              }
+          }
       }
 
       /**
-       * @brief  Read the memory parameters (manufacturer and type).
-       * @return qspi::ok if successful, or a qspi error otherwise.
+       * @brief  Check if a range of blocks is known to be erased.
+       * @param  blknum: first block of the range.
+       * @param  nblocks: number of blocks.
+       * @return true if all blocks are erased, false otherwise.
        */
-      qspi_impl::qspi_result_t
-      qspi_impl::read_JEDEC_ID (void)
+      bool
+      qspi_impl::is_blank (posix::block_device::blknum_t blknum,
+                           std::size_t nblocks)
       {
-        qspi_impl::qspi_result_t result = error;
-        uint8_t buff[3];
-        QSPI_CommandTypeDef sCommand;
+        if (blank_map_ == nullptr)
+          {
+            return false;
+          }
 
-        // Read command settings
-        sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
-        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
-        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
-        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
-        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
-        sCommand.InstructionMode = QSPI_INSTRUCTION_1_LINE;
-        sCommand.AddressMode = QSPI_ADDRESS_NONE;
-        sCommand.DataMode = QSPI_DATA_1_LINE;
-        sCommand.DummyCycles = 0;
-        sCommand.NbData = 3;
-        sCommand.Instruction = JEDEC_ID;
+        for (; nblocks > 0; nblocks--, blknum++)
+          {
+            if ((blank_map_[blknum / 32] & (1u << (blknum % 32))) == 0)
+              {
+                return false;
+              }
+          }
 
-        // Initiate read and wait for the event
-        result = qspi_command (hqspi_, &sCommand, TIMEOUT);
-        if (result == ok)
+        return true;
+      }
+
+      /**
+       * @brief  Update the map of erased sectors.
+       * @param  address: start address of the range.
+       * @param  length: length of the range in bytes.
+       * @param  state: true if the range was erased, false if programmed.
+       */
+      void
+      qspi_impl::set_blank (uint32_t address, size_t length, bool state)
+      {
+        if (blank_map_ != nullptr && length > 0)
           {
-            result = (qspi_impl::qspi_result_t) HAL_QSPI_Receive_IT (hqspi_,
-                                                                     buff);
-            if (result == ok)
+            size_t sector = address / get_sector_size ();
+            size_t last = (address + length - 1) / get_sector_size ();
+
+            for (; sector <= last; sector++)
               {
-                if (semaphore_.timed_wait (TIMEOUT) == rtos::result::ok)
+                if (state)
                   {
-                    manufacturer_ID_ = buff[0];
-                    memory_type_ = buff[1] << 8;
-                    memory_type_ += buff[2];
-
-                    // Do we know this device?
-                    result = type_not_found;
-                    for (const qspi_manuf_t* pqm = qspi_manufacturers;
-                        pqm->manufacturer_ID != 0; pqm++)
-                      {
-                        if (pqm->manufacturer_ID == manufacturer_ID_)
-                          {
-                            // Manufacturer found
-                            for (const qspi_device_t* pqd = pqm->devices;
-                                pqd->device_ID != 0; pqd++)
-                              {
-                                if (pqd->device_ID == memory_type_)
-                                  {
-                                    // Device found, initialize class
-                                    pmanufacturer_ = pqm->manufacturer_name;
-                                    pdevice_ = pqd;
-                                    pimpl = pqm->qspi_factory ();
-                                    result = ok;
-                                    break;
-                                  }
-                              }
-                          }
-                      }
+                    blank_map_[sector / 32] |= (1u << (sector % 32));
                   }
                 else
                   {
-                    result = timeout;
+                    blank_map_[sector / 32] &= ~(1u << (sector % 32));
                   }
               }
           }
-
-        return result;
       }
 
       /**
-       * @brief  Switch the flash chip into or out of deep sleep.
-       * @param  state: if true, enter deep sleep; if false, exit deep sleep.
-       * @return qspi::ok if successful, an error otherwise.
+       * @brief  Check if a range of blocks was discarded (trimmed) by the
+       *    file system.
+       * @param  blknum: first block of the range.
+       * @param  nblocks: number of blocks.
+       * @return true if all blocks are trimmed, false otherwise.
        */
-      qspi_impl::qspi_result_t
-      qspi_impl::sleep (bool state)
+      bool
+      qspi_impl::is_trimmed (posix::block_device::blknum_t blknum,
+                             std::size_t nblocks)
       {
-        qspi_impl::qspi_result_t result = error;
-        QSPI_CommandTypeDef sCommand;
-
-        // Initial command settings
-        sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
-        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
-        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
-        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
-        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
-        sCommand.InstructionMode = QSPI_INSTRUCTION_4_LINES;
-        sCommand.AddressMode = QSPI_ADDRESS_NONE;
-        sCommand.DataMode = QSPI_DATA_NONE;
-        sCommand.DummyCycles = 0;
+        if (trim_map_ == nullptr)
+          {
+            return false;
+          }
 
-        // Enable/disable deep sleep
-        sCommand.Instruction = state ? POWER_DOWN : RELEASE_POWER_DOWN;
+        for (; nblocks > 0; nblocks--, blknum++)
+          {
+            if ((trim_map_[blknum / 32] & (1u << (blknum % 32))) == 0)
+              {
+                return false;
+              }
+          }
+
+        return true;
+      }
+
+      /**
+       * @brief  Update the map of trimmed blocks.
+       * @param  blknum: first block of the range.
+       * @param  nblocks: number of blocks.
+       * @param  state: true if the blocks were trimmed, false if written.
+       */
+      void
+      qspi_impl::set_trimmed (posix::block_device::blknum_t blknum,
+                              std::size_t nblocks, bool state)
+      {
+        if (trim_map_ != nullptr)
+          {
+            for (; nblocks > 0; nblocks--, blknum++)
+              {
+                if (state)
+                  {
+                    trim_map_[blknum / 32] |= (1u << (blknum % 32));
+                  }
+                else
+                  {
+                    trim_map_[blknum / 32] &= ~(1u << (blknum % 32));
+                  }
+              }
+          }
+      }
+
+      /**
+       * @brief  Record blocks discarded by the file system. Their content is
+       *    dropped from the write-back cache; they are erased later, by
+       *    pre_erase(), or on the next write without reading them first.
+       * @param  blknum: first block of the range.
+       * @param  nblocks: number of blocks.
+       */
+      void
+      qspi_impl::trim (posix::block_device::blknum_t blknum,
+                       std::size_t nblocks)
+      {
+        for (size_t i = 0; i < cache_entries_; i++)
+          {
+            if (cache_[i].stamp != 0 && cache_[i].blknum >= blknum
+                && cache_[i].blknum < blknum + nblocks)
+              {
+                cache_[i].stamp = 0;
+                cache_[i].dirty = false;
+              }
+          }
+
+        set_trimmed (blknum, nblocks, true);
+      }
+
+      /**
+       * @brief  One step of the background pre-erase: if no erase is in
+       *    progress, start erasing the next trimmed sector, or the whole
+       *    64K/32K block if all its sectors are trimmed or already erased.
+       *    The erase is not waited for; reads suspend it and writes wait
+       *    for it to end.
+       * @return 1 if an erase is in progress, 0 if there is nothing left to
+       *    erase, -1 if error.
+       */
+      int
+      qspi_impl::pre_erase (void)
+      {
+        if (erase_status () == busy)
+          {
+            return 1;
+          }
+
+        for (size_t sector = 0; sector < num_blocks_; sector++)
+          {
+            if (is_trimmed (sector, 1) && !is_blank (sector, 1)
+                && cache_lookup (sector) == nullptr)
+              {
+                size_t sector_size = block_logical_size_bytes_;
+                size_t per64K = BLOCK_64K_SIZE * chips_ / sector_size;
+                size_t per32K = BLOCK_32K_SIZE * chips_ / sector_size;
+                size_t first;
+                erase_kind_t kind = erase_kind_sector;
+
+                // try the largest erase covering only unused sectors
+                first = sector & ~(per64K - 1);
+                if (unused (first, per64K))
+                  {
+                    kind = erase_kind_block64K;
+                  }
+                else
+                  {
+                    first = sector & ~(per32K - 1);
+                    if (unused (first, per32K))
+                      {
+                        kind = erase_kind_block32K;
+                      }
+                    else
+                      {
+                        first = sector;
+                      }
+                  }
+
+                if (start_erase (first * sector_size, kind) != ok)
+                  {
+                    errno = EIO;
+                    return -1;
+                  }
+                return 1;
+              }
+          }
+
+        return 0;
+      }
+
+      /**
+       * @brief  Check if a range of blocks holds no live data (i.e. each
+       *    block is either trimmed or erased).
+       * @param  blknum: first block of the range.
+       * @param  nblocks: number of blocks.
+       * @return true if the blocks can be erased, false otherwise.
+       */
+      bool
+      qspi_impl::unused (posix::block_device::blknum_t blknum,
+                         std::size_t nblocks)
+      {
+        if (blknum + nblocks > num_blocks_)
+          {
+            return false;
+          }
+
+        for (; nblocks > 0; nblocks--, blknum++)
+          {
+            if (!is_trimmed (blknum, 1) && !is_blank (blknum, 1))
+              {
+                return false;
+              }
+            if (cache_lookup (blknum) != nullptr)
+              {
+                // the cache holds newer data
+                return false;
+              }
+          }
+
+        return true;
+      }
+
+      /**
+       * @brief  Background pre-erase thread function. Run it at a low
+       *    priority, so that trimmed sectors are erased only when the
+       *    system is idle, e.g.:
+       *
+       *    rtos::thread th { "pre-erase", qspi_impl::pre_erase_thread, &flash,
+       *        attr };
+       *
+       * @param  args: pointer to the (lockable) block device.
+       * @return never returns.
+       */
+      void*
+      qspi_impl::pre_erase_thread (void* args)
+      {
+        posix::block_device* bd = (posix::block_device*) args;
+
+        for (;;)
+          {
+            int result = bd->ioctl (ioctl_pre_erase);
+            rtos::sysclock.sleep_for (
+                (result > 0) ? PRE_ERASE_POLL : PRE_ERASE_IDLE);
+          }
+
+        return nullptr;
+      }
+
+      /**
+       * @brief  Find a block in the write-back cache.
+       * @param  blknum: the block number.
+       * @return Pointer to the cache entry holding the block, or nullptr.
+       */
+      qspi_impl::cache_entry_t*
+      qspi_impl::cache_lookup (posix::block_device::blknum_t blknum)
+      {
+        for (size_t i = 0; i < cache_entries_; i++)
+          {
+            if (cache_[i].stamp != 0 && cache_[i].blknum == blknum)
+              {
+                return &cache_[i];
+              }
+          }
+        return nullptr;
+      }
+
+      /**
+       * @brief  Write a block into the write-back cache. If the block is not
+       *    cached yet, the least recently used entry is evicted (and written
+       *    back to flash if dirty).
+       * @param  buf: block data.
+       * @param  blknum: the block number.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::cache_write (const uint8_t* buf,
+                              posix::block_device::blknum_t blknum)
+      {
+        cache_entry_t* pce = cache_lookup (blknum);
+
+        if (pce == nullptr)
+          {
+            // select a free entry or the least recently used one
+            pce = &cache_[0];
+            for (size_t i = 1; i < cache_entries_ && pce->stamp != 0; i++)
+              {
+                if (cache_[i].stamp < pce->stamp)
+                  {
+                    pce = &cache_[i];
+                  }
+              }
+            if (cache_flush (pce) != ok)
+              {
+                return error;
+              }
+            pce->blknum = blknum;
+          }
+
+        memcpy (cache_data (pce), buf, block_logical_size_bytes_);
+        pce->dirty = true;
+        pce->stamp = ++cache_clock_;
+
+        return ok;
+      }
+
+      /**
+       * @brief  Write back a cache entry, if dirty.
+       * @param  pce: pointer to the cache entry.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::cache_flush (cache_entry_t* pce)
+      {
+        if (pce->stamp != 0 && pce->dirty)
+          {
+            if (write_blocks (cache_data (pce), pce->blknum, 1) != 1)
+              {
+                return error;
+              }
+            pce->dirty = false;
+          }
+        return ok;
+      }
+
+      /**
+       * @brief  Write back all dirty cache entries, in ascending block order.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::cache_flush_all (void)
+      {
+        cache_entry_t* pce;
+
+        do
+          {
+            pce = nullptr;
+            for (size_t i = 0; i < cache_entries_; i++)
+              {
+                if (cache_[i].stamp != 0 && cache_[i].dirty
+                    && (pce == nullptr || cache_[i].blknum < pce->blknum))
+                  {
+                    pce = &cache_[i];
+                  }
+              }
+            if (pce != nullptr && cache_flush (pce) != ok)
+              {
+                return error;
+              }
+          }
+        while (pce != nullptr);
+
+        return ok;
+      }
+
+      /**
+       * @brief  Read the flash chip ID and initialize the internal structures accordingly.
+       * @return qspi_impl::ok if successful, or a qspi_impl error if the flash could not be identified
+       * 	 or it is not supported by the driver.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::initialize (void)
+      {
+        qspi_impl::qspi_result_t result;
+
+        // Read flash device ID
+        if ((result = qspi_impl::read_JEDEC_ID ()) != ok)
+          {
+            // Flash device might be in deep sleep or, after a reset of the
+            // controller only, in continuous read mode
+            qspi_impl::sleep (false);
+            exit_continuous ();
+
+            // Reset and try reading ID again
+            if ((result = qspi_impl::reset_chip ()) == ok)
+              {
+                result = qspi_impl::read_JEDEC_ID ();
+              }
+          }
+
+        // If all OK, switch flash device in quad mode
+        if (result == ok)
+          {
+            // Use DTR reads if both the device and the QSPI clock allow it,
+            // otherwise fall back to SDR; the sample shifting must be off
+            // in DDR mode, the board's setting is restored for SDR
+            clock_hz_ = HAL_RCC_GetHCLKFreq ()
+                / (hqspi_->Init.ClockPrescaler + 1);
+            ddr_ = ddr_reads_ && pdevice_->DDR_support
+                && clock_hz_ <= pdevice_->ddr_max_clock;
+            if (ddr_)
+              {
+                if (!shift_cleared_)
+                  {
+                    sample_shifting_ = hqspi_->Init.SampleShifting;
+                    shift_cleared_ = true;
+                  }
+                hqspi_->Init.SampleShifting = QSPI_SAMPLE_SHIFTING_NONE;
+                CLEAR_BIT(hqspi_->Instance->CR, QUADSPI_CR_SSHIFT);
+              }
+            else if (shift_cleared_)
+              {
+                hqspi_->Init.SampleShifting = sample_shifting_;
+                MODIFY_REG(hqspi_->Instance->CR, QUADSPI_CR_SSHIFT,
+                           sample_shifting_);
+                shift_cleared_ = false;
+              }
+            // Addresses above 16 MB (of a chip) need 4 bytes; the
+            // controller must know the flash size (of both chips in
+            // dual-flash mode) for the memory mapped mode
+            address_4B_ = capacity_ / chips_ > ADDRESS_3B_LIMIT
+                && pdevice_->address_mode != ADDRESS_3B;
+            hqspi_->Init.FlashSize = 30 - __builtin_clz (capacity_);
+            MODIFY_REG(hqspi_->Instance->DCR, QUADSPI_DCR_FSIZE,
+                       hqspi_->Init.FlashSize << QUADSPI_DCR_FSIZE_Pos);
+
+            build_commands ();
+            result = enter_quad_mode ();
+            if (result == ok)
+              {
+                calibrate_transfers ();
+              }
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Set flash device to default state.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::uninitialize (void)
+      {
+        release_intern ();
+        if (discovered_)
+          {
+            pdevice_ = nullptr;         // it was owned by pimpl
+            discovered_ = false;
+          }
+        qspi_impl::sleep (false);
+        return qspi_impl::reset_chip ();
+      }
+
+      /**
+       * @brief  Read the memory parameters (manufacturer and type).
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::read_JEDEC_ID (void)
+      {
+        qspi_impl::qspi_result_t result = error;
+        uint8_t buff[6];
+        QSPI_CommandTypeDef sCommand;
+
+        // In dual-flash mode, the bytes of the two chips are interleaved
+        chips_ = (hqspi_->Init.DualFlash == QSPI_DUALFLASH_ENABLE) ? 2 : 1;
+
+        // Read command settings
+        sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
+        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
+        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
+        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
+        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
+        sCommand.InstructionMode = QSPI_INSTRUCTION_1_LINE;
+        sCommand.AddressMode = QSPI_ADDRESS_NONE;
+        sCommand.DataMode = QSPI_DATA_1_LINE;
+        sCommand.DummyCycles = 0;
+        sCommand.NbData = 3 * chips_;
+        sCommand.Instruction = JEDEC_ID;
+
+        // Initiate read and wait for the event
         result = qspi_command (hqspi_, &sCommand, TIMEOUT);
+        if (result == ok)
+          {
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_Receive_IT (hqspi_,
+                                                                     buff);
+            if (result == ok)
+              {
+                if (semaphore_.timed_wait (TIMEOUT) == rtos::result::ok)
+                  {
+                    manufacturer_ID_ = buff[0];
+                    memory_type_ = buff[chips_] << 8;
+                    memory_type_ += buff[2 * chips_];
+
+                    // Do we know this device? Both chips must be the same
+                    result = type_not_found;
+                    if (chips_ > 1
+                        && (buff[0] != buff[1] || buff[2] != buff[3]
+                            || buff[4] != buff[5]))
+                      {
+                        trace::printf ("Different chips %02X%02X%02X, "
+                                       "%02X%02X%02X\n",
+                                       buff[0], buff[2], buff[4], buff[1],
+                                       buff[3], buff[5]);
+                        return result;
+                      }
+                    if (fixed_device_ != nullptr)
+                      {
+                        // Device selected at compile time, just check it
+                        if (fixed_manufacturer_ID_ == manufacturer_ID_
+                            && fixed_device_->device_ID == memory_type_)
+                          {
+                            use_device (fixed_manufacturer_, fixed_device_,
+                                        fixed_intern_);
+                            result = ok;
+                          }
+                        return result;
+                      }
+
+                    for (const qspi_manuf_t* pqm = qspi_manufacturers;
+                        pqm->manufacturer_ID != 0; pqm++)
+                      {
+                        if (pqm->manufacturer_ID == manufacturer_ID_)
+                          {
+                            // Manufacturer found
+                            for (const qspi_device_t* pqd = pqm->devices;
+                                pqd->device_ID != 0; pqd++)
+                              {
+                                if (pqd->device_ID == memory_type_)
+                                  {
+                                    // Device found, initialize class
+                                    use_device (pqm->manufacturer_name, pqd,
+                                                pqm->qspi_factory ());
+                                    result = ok;
+                                    break;
+                                  }
+                              }
+                          }
+                      }
+
+                    // Unknown devices are described by their SFDP tables,
+                    // the known ones are cross-checked
+                    result = (result == ok) ? check_sfdp () : discover_sfdp ();
+                  }
+                else
+                  {
+                    result = timeout;
+                  }
+              }
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Select a device from the tables, or the one given at
+       *    compile time.
+       * @param  manufacturer: the manufacturer's name.
+       * @param  device: the device description.
+       * @param  intern: the manufacturer specific functions.
+       */
+      void
+      qspi_impl::use_device (const char* manufacturer,
+                             const qspi_device_t* device, qspi_intern* intern)
+      {
+        release_intern ();
+        pimpl = intern;
+        pmanufacturer_ = manufacturer;
+        pdevice_ = device;
+        discovered_ = false;
+
+        // Capacity codes above 0x19 (32 MB) continue from 0x20
+        uint8_t code = device->device_ID & 0xFF;
+        capacity_ = chips_ << ((code < 0x20) ? code : code - 6);
+      }
+
+      /**
+       * @brief  Free the manufacturer specific functions, unless they
+       *    belong to a device given at compile time.
+       */
+      void
+      qspi_impl::release_intern (void)
+      {
+        if (pimpl != fixed_intern_)
+          {
+            delete pimpl;
+          }
+        pimpl = nullptr;
+      }
+
+      /**
+       * @brief  Set the device at compile time (see qspi_impl_t): the device
+       *    tables are not searched and the SFDP tables are not read, the
+       *    flash ID is only checked.
+       * @param  manufacturer_ID: the expected manufacturer ID.
+       * @param  manufacturer: the manufacturer's name.
+       * @param  device: the device description.
+       * @param  intern: the manufacturer specific functions (not freed).
+       */
+      void
+      qspi_impl::set_device (uint8_t manufacturer_ID, const char* manufacturer,
+                             const qspi_device_t* device, qspi_intern* intern)
+      {
+        fixed_manufacturer_ID_ = manufacturer_ID;
+        fixed_manufacturer_ = manufacturer;
+        fixed_device_ = device;
+        fixed_intern_ = intern;
+      }
+
+      /**
+       * @brief  Describe an unknown device by its SFDP parameters, if the
+       *    driver can run it (4-4-4 mode, standard erase sizes). Addressing
+       *    is 24 bits, larger devices are limited to their first 16 MB.
+       * @return qspi::ok if successful, qspi::type_not_found otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::discover_sfdp (void)
+      {
+        sfdp_params_t params;
+
+        // The SFDP tables are read byte-wise from a single chip
+        if (chips_ > 1)
+          {
+            return type_not_found;
+          }
+
+        if (qspi_generic::read_parameters (this, params) != ok
+            || qspi_generic::is_usable (params) == false)
+          {
+            return type_not_found;
+          }
+
+        qspi_generic* pg = new qspi_generic
+          { params, memory_type_ };
+
+        release_intern ();
+        pimpl = pg;
+        pdevice_ = pg->device ();
+        discovered_ = true;
+        pmanufacturer_ = "JEDEC SFDP";
+        capacity_ = (params.capacity > 0x1000000) ? 0x1000000 : params.capacity;
+        trace::printf ("SFDP device %02X%04X, %u bytes, read %02X\n",
+                       manufacturer_ID_, memory_type_, capacity_,
+                       params.read_444);
+
+        return ok;
+      }
+
+      /**
+       * @brief  Cross-check the description of a known device against its
+       *    SFDP parameters, if any; the differences are only reported.
+       * @return qspi::ok.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::check_sfdp (void)
+      {
+        sfdp_params_t params;
+
+        if (chips_ == 1 && qspi_generic::read_parameters (this, params) == ok)
+          {
+            if (params.capacity != capacity_)
+              {
+                trace::printf ("SFDP capacity %u, table %u\n",
+                               params.capacity, capacity_);
+              }
+            if (pdevice_->sector_size == 4096 && params.erase_4K == 0)
+              {
+                trace::printf ("SFDP reports no 4K erase\n");
+              }
+            if (params.page_size < PAGE_SIZE)
+              {
+                trace::printf ("SFDP page size %u\n", params.page_size);
+              }
+          }
+
+        return ok;
+      }
+
+      /**
+       * @brief  Switch the flash chip into or out of deep sleep.
+       * @param  state: if true, enter deep sleep; if false, exit deep sleep.
+       * @return qspi::ok if successful, an error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::sleep (bool state)
+      {
+        qspi_impl::qspi_result_t result = error;
+        QSPI_CommandTypeDef sCommand;
+
+        // Initial command settings
+        sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
+        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
+        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
+        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
+        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
+        sCommand.InstructionMode = QSPI_INSTRUCTION_4_LINES;
+        sCommand.AddressMode = QSPI_ADDRESS_NONE;
+        sCommand.DataMode = QSPI_DATA_NONE;
+        sCommand.DummyCycles = 0;
+
+        // Enable/disable deep sleep
+        sCommand.Instruction = state ? POWER_DOWN : RELEASE_POWER_DOWN;
+        result = qspi_command (hqspi_, &sCommand, TIMEOUT);
+        if (result == ok)
+          {
+            sleeping_ = state;
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Map the flash to the addressing space of the controller, starting at
+       * 	address 0x90000000. If the device supports it, the flash is
+       * 	switched to continuous read mode: the instruction is sent only
+       * 	with the first access, the next ones start with the address.
+       * @return qspi::ok if successful, false otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::enter_mem_mapped (void)
+      {
+        qspi_impl::qspi_result_t result = error;
+        QSPI_CommandTypeDef sCommand;
+        QSPI_MemoryMappedTypeDef sMemMappedCfg;
+
+        if (mapped_)
+          {
+            return ok;
+          }
+
+        if (pdevice_ != nullptr)
+          {
+            read_command (sCommand);
+
+            if (continuous_reads_ && pdevice_->continuous_support
+                && pdevice_->alt_bytes_mode != QSPI_ALTERNATE_BYTES_NONE)
+              {
+                sCommand.AlternateBytes = pdevice_->continuous_alt;
+                sCommand.SIOOMode = QSPI_SIOO_INST_ONLY_FIRST_CMD;
+              }
+
+            sMemMappedCfg.TimeOutActivation = QSPI_TIMEOUT_COUNTER_DISABLE;
+
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_MemoryMapped (
+                hqspi_, &sCommand, &sMemMappedCfg);
+            mapped_ = (result == ok);
+            continuous_ = mapped_
+                && (sCommand.SIOOMode == QSPI_SIOO_INST_ONLY_FIRST_CMD);
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Set-up the quad I/O fast read command, in DTR mode if
+       *    active (the instruction is always sent in SDR, the address, alt
+       *    bytes and data on both clock edges).
+       * @param  cmd: the command to set-up.
+       */
+      void
+      qspi_impl::read_command (QSPI_CommandTypeDef& cmd)
+      {
+        bool opcodes_4B = address_4B_
+            && pdevice_->address_mode == ADDRESS_4B_OPCODES;
+
+        cmd.AddressSize = address_size ();
+        cmd.AlternateByteMode = pdevice_->alt_bytes_mode;
+        cmd.AlternateBytesSize = pdevice_->alt_bytes_size;
+        cmd.AlternateBytes = pdevice_->alt_bytes;
+        cmd.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
+        cmd.InstructionMode = QSPI_INSTRUCTION_4_LINES;
+        cmd.AddressMode = QSPI_ADDRESS_4_LINES;
+        cmd.DataMode = QSPI_DATA_4_LINES;
+        if (ddr_)
+          {
+            // 8 bits of alt bytes take a single clock
+            cmd.DdrMode = QSPI_DDR_MODE_ENABLE;
+            cmd.DdrHoldHalfCycle = pdevice_->ddr_hold;
+            cmd.DummyCycles = pdevice_->ddr_dummy_cycles
+                - ((pdevice_->alt_bytes_mode != QSPI_ALTERNATE_BYTES_NONE) ?
+                    1 : 0);
+            cmd.Instruction =
+                opcodes_4B ?
+                    FAST_READ_QUAD_IN_OUT_DTR_4B : FAST_READ_QUAD_IN_OUT_DTR;
+          }
+        else
+          {
+            cmd.DdrMode = QSPI_DDR_MODE_DISABLE;
+            cmd.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
+            cmd.DummyCycles = pdevice_->dummy_cycles
+                - pdevice_->alt_bytes_cycles;
+            cmd.Instruction =
+                (pdevice_->read_instruction != 0) ?
+                    pdevice_->read_instruction :
+                opcodes_4B ?
+                    FAST_READ_QUAD_IN_OUT_4B : FAST_READ_QUAD_IN_OUT;
+          }
+      }
+
+      /**
+       * @brief  Switch the flash to 4 bytes addresses, if it uses the 4
+       *    bytes address mode; devices with 4 bytes address instructions
+       *    need no switch. Called after each entry in quad mode, a reset
+       *    returns the flash to 3 bytes addresses.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::enter_address_mode (void)
+      {
+        QSPI_CommandTypeDef sCommand;
+
+        if (!address_4B_ || pdevice_->address_mode != ADDRESS_4B_MODE)
+          {
+            return ok;
+          }
+
+        sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
+        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
+        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
+        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
+        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
+        sCommand.InstructionMode = QSPI_INSTRUCTION_4_LINES;
+        sCommand.AddressMode = QSPI_ADDRESS_NONE;
+        sCommand.DataMode = QSPI_DATA_NONE;
+        sCommand.DummyCycles = 0;
+        sCommand.Instruction = ENTER_4B_ADDRESS_MODE;
+
+        return qspi_command (hqspi_, &sCommand, TIMEOUT);
+      }
+
+      /**
+       * @brief  Return the dummy cycles of the reads, to be set in the flash
+       *    by the manufacturer specific quad mode initialization.
+       * @return the number of dummy cycles.
+       */
+      uint8_t
+      qspi_impl::read_dummy_cycles (void)
+      {
+        return ddr_ ? pdevice_->ddr_dummy_cycles : pdevice_->dummy_cycles;
+      }
+
+      /**
+       * @brief  Take the flash out of the continuous read mode. The flash
+       *    interprets the first clocks as an address, followed by the mode
+       *    bits; 10 clocks with all lines high cover a 4-byte address and
+       *    the mode bits, which then end the continuous mode, for all the
+       *    supported devices. With a 3-byte address, the mode bits come
+       *    after 6 clocks and the last ones are dummy clocks of an aborted
+       *    read. The longest form is always used, since after a reset of
+       *    the controller only, the address mode of the flash is not known
+       *    (in SPI mode, this is the harmless 0xFF command).
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::exit_continuous (void)
+      {
+        QSPI_CommandTypeDef sCommand;
+
+        sCommand.AddressSize = QSPI_ADDRESS_32_BITS;
+        sCommand.Address = 0xFFFFFFFF;
+        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_4_LINES;
+        sCommand.AlternateBytesSize = QSPI_ALTERNATE_BYTES_8_BITS;
+        sCommand.AlternateBytes = 0xFF;
+        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
+        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
+        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
+        sCommand.InstructionMode = QSPI_INSTRUCTION_NONE;
+        sCommand.AddressMode = QSPI_ADDRESS_4_LINES;
+        sCommand.DataMode = QSPI_DATA_NONE;
+        sCommand.DummyCycles = 0;
+
+        continuous_ = false;
+        return (qspi_impl::qspi_result_t) HAL_QSPI_Command (hqspi_, &sCommand,
+                                                            TIMEOUT);
+      }
+
+      /**
+       * @brief  Make the memory mapped window cacheable (write-through, read
+       *    allocate), so that mapped reads of hot data hit the D-cache.
+       *    Two MPU regions are used: the first one covers the whole QSPI
+       *    space as strongly ordered, no access, to stop the speculative
+       *    reads beyond the flash; the second one, with a higher priority,
+       *    maps the flash itself. The driver keeps the window coherent,
+       *    by invalidating the lines of every programmed or erased range.
+       *    The flash must be initialized (opened) first.
+       * @param  region: the first of the two MPU regions to use.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::set_mapped_cacheable (uint8_t region)
+      {
+        MPU_Region_InitTypeDef sRegion;
+        uint32_t regions = (MPU->TYPE & MPU_TYPE_DREGION_Msk)
+            >> MPU_TYPE_DREGION_Pos;
+
+        if (pdevice_ == nullptr || (uint32_t) region + 1 >= regions)
+          {
+            return error;
+          }
+
+        sRegion.Enable = MPU_REGION_ENABLE;
+        sRegion.Number = region;
+        sRegion.BaseAddress = QSPI_BASE;
+        sRegion.Size = MPU_REGION_SIZE_256MB;
+        sRegion.SubRegionDisable = 0;
+        sRegion.TypeExtField = MPU_TEX_LEVEL0;
+        sRegion.AccessPermission = MPU_REGION_NO_ACCESS;
+        sRegion.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+        sRegion.IsShareable = MPU_ACCESS_SHAREABLE;
+        sRegion.IsCacheable = MPU_ACCESS_NOT_CACHEABLE;
+        sRegion.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
+
+        {
+          rtos::interrupts::critical_section ics;
+
+          HAL_MPU_Disable ();
+          HAL_MPU_ConfigRegion (&sRegion);
+
+          // The flash size is a power of two, the MPU size is log2 - 1
+          sRegion.Number = region + 1;
+          sRegion.Size = 30 - __builtin_clz (capacity_);
+          sRegion.AccessPermission = MPU_REGION_PRIV_RO_URO;
+          sRegion.DisableExec = MPU_INSTRUCTION_ACCESS_ENABLE;
+          sRegion.IsShareable = MPU_ACCESS_NOT_SHAREABLE;
+          sRegion.IsCacheable = MPU_ACCESS_CACHEABLE;
+          HAL_MPU_ConfigRegion (&sRegion);
+
+          HAL_MPU_Enable (MPU_PRIVILEGED_DEFAULT);
+        }
+
+        // Drop the lines possibly loaded with the previous attributes
+        SCB_InvalidateDCache_by_Addr ((uint32_t*) QSPI_BASE,
+                                      get_sector_count () * get_sector_size ());
+
+        return ok;
+      }
+
+      /**
+       * @brief  Read a block of data from the flash.
+       * @param  address: start address in flash where to read from.
+       * @param  buff: buffer where to copy data to.
+       * @param  count: amount of data to be retrieved from flash.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::read (uint32_t address, uint8_t* buff, size_t count)
+      {
+        qspi_impl::qspi_result_t result = error;
+
+        // In dual-flash mode, the transfers are made of byte pairs
+        if (pdevice_ != nullptr && ((address | count) & (chips_ - 1)) == 0)
+          {
+            // An erase in progress (on behalf of another thread) must be
+            // suspended first
+            bool suspended = false;
+            if (erase_busy_)
+              {
+                result = suspend_erase (suspended);
+                if (result == busy)
+                  {
+                    // The device cannot suspend an erase, wait for its end
+                    result = wait_erase (operation_timeout (erase_which_));
+                  }
+                if (result != ok)
+                  {
+                    if (suspended)
+                      {
+                        // The suspend failed halfway, set the erase going
+                        // and its polling back
+                        resume_erase ();
+                      }
+                    return result;
+                  }
+              }
+
+            /**
+             * Keep the data cache coherent with the DMA transfer: nothing to
+             * do for non-cacheable buffers; cache line aligned buffers are
+             * invalidated before (to drop dirty lines) and after (to drop
+             * lines speculatively loaded meanwhile); the other buffers
+             * would share lines with unrelated data, therefore their
+             * unaligned ends go through a bounce buffer. Small transfers
+             * are copied by the CPU, without DMA and cache maintenance.
+             */
+            transfer_t mode = transfer_mode (count);
+            if (mode != xfer_dma)
+              {
+                result = issue_command (cmd_read, address, count);
+                if (result == ok)
+                  {
+                    result = receive (buff, count, mode);
+                  }
+              }
+            else
+              {
+                switch (dma_buffer (buff, count))
+                  {
+                  case dma_uncached:
+                    dma_uncached_++;
+                    result = read_dma (address, buff, count);
+                    break;
+
+                  case dma_aligned:
+                    dma_maintained_++;
+                    invalidate_dcache (buff, count);
+                    result = read_dma (address, buff, count);
+                    invalidate_dcache (buff, count);
+                    break;
+
+                  default:
+                    dma_bounced_++;
+                    result = read_bounced (address, buff, count);
+                    break;
+                  }
+              }
+
+            if (suspended)
+              {
+                qspi_impl::qspi_result_t res = resume_erase ();
+                result = (result == ok) ? res : result;
+              }
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Read from the flash with DMA, no cache maintenance.
+       * @param  address: start address in flash where to read from.
+       * @param  buff: buffer where to copy data to.
+       * @param  count: amount of data to be retrieved from flash.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::read_dma (uint32_t address, uint8_t* buff, size_t count)
+      {
+        qspi_impl::qspi_result_t result;
+
+        // Read chunk by chunk, each one started from the thread context
+        // once the previous one ended (the HAL command functions wait on
+        // the tick, they must not be called from cb_event())
+        xfer_address_ = address;
+        xfer_buff_ = buff;
+        xfer_left_ = count;
+        do
+          {
+            size_t chunk = (xfer_left_ > DMA_MAX_CHUNK) ? //
+                DMA_MAX_CHUNK : xfer_left_;
+
+            result = read_chunk ();
+            if (result == ok)
+              {
+                result =
+                    (semaphore_.timed_wait (transfer_timeout (chunk))
+                        == rtos::result::ok) ? ok : timeout;
+              }
+          }
+        while (result == ok && xfer_left_ > 0);
+        xfer_left_ = 0;
+
+        return result;
+      }
+
+      /**
+       * @brief  Read from the flash into a buffer that is not cache line
+       *    aligned. Small reads go entirely through the bounce buffer;
+       *    for larger ones, only the partial cache lines at both ends do,
+       *    the aligned middle is transferred directly (unless, in dual-flash
+       *    mode, the head would be an odd number of bytes).
+       * @param  address: start address in flash where to read from.
+       * @param  buff: buffer where to copy data to.
+       * @param  count: amount of data to be retrieved from flash.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::read_bounced (uint32_t address, uint8_t* buff, size_t count)
+      {
+        qspi_impl::qspi_result_t result = ok;
+        uint8_t* bounce = (uint8_t*) (((uint32_t) bounce_buff_ + CACHE_LINE - 1)
+            & ~(CACHE_LINE - 1));
+        size_t head = (CACHE_LINE - ((uint32_t) buff & (CACHE_LINE - 1)))
+            & (CACHE_LINE - 1);
+        size_t middle;
+
+        if ((head & (chips_ - 1)) != 0)
+          {
+            // In dual-flash mode, a transfer cannot start or end on an odd
+            // address: the whole read goes through the bounce buffer
+            while (count > 0 && result == ok)
+              {
+                size_t n = (count > BOUNCE_SIZE) ? BOUNCE_SIZE : count;
+
+                invalidate_dcache (bounce, n);
+                result = read_dma (address, bounce, n);
+                invalidate_dcache (bounce, n);
+                memcpy (buff, bounce, n);
+                address += n;
+                buff += n;
+                count -= n;
+              }
+            return result;
+          }
+
+        if (count <= BOUNCE_SIZE)
+          {
+            head = count;
+          }
+        middle = (count - head) & ~(CACHE_LINE - 1);
+
+        for (int part = 0; part < 3 && result == ok; part++)
+          {
+            // head, middle, tail
+            size_t n = (part == 0) ? head :
+                       (part == 1) ? middle : count - head - middle;
+            if (n == 0)
+              {
+                continue;
+              }
+
+            if (part == 1)
+              {
+                invalidate_dcache (buff, n);
+                result = read_dma (address, buff, n);
+                invalidate_dcache (buff, n);
+              }
+            else
+              {
+                invalidate_dcache (bounce, n);
+                result = read_dma (address, bounce, n);
+                invalidate_dcache (bounce, n);
+                memcpy (buff, bounce, n);
+              }
+            address += n;
+            buff += n;
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Find out which cache maintenance a DMA buffer needs.
+       * @param  buff: the buffer.
+       * @param  count: its size.
+       * @return dma_uncached if the D-cache is off or the buffer is in DTCM
+       *    or entirely in a non-cacheable MPU region, dma_aligned if the buffer
+       *    covers whole cache lines, dma_misaligned otherwise.
+       */
+      qspi_impl::dma_buffer_t
+      qspi_impl::dma_buffer (const uint8_t* buff, size_t count)
+      {
+        uint32_t start = (uint32_t) buff;
+        uint32_t end = start + count - 1;
+
+        if ((SCB->CCR & (uint32_t) SCB_CCR_DC_Msk) == 0
+            || (start >= RAMDTCM_BASE && end < SRAM1_BASE)
+            || mpu_uncached (start, end))
+          {
+            return dma_uncached;
+          }
+
+        return (((start | count) & (CACHE_LINE - 1)) == 0) ?
+            dma_aligned : dma_misaligned;
+      }
+
+      /**
+       * @brief  Check if an address is cacheable, according to the MPU
+       *    regions (the highest numbered region that matches wins).
+       * @param  address: the address.
+       * @return true if the address is cached by the D-cache.
+       */
+      bool
+      qspi_impl::mpu_cacheable (uint32_t address)
+      {
+        bool cacheable = true;  // default memory map, SRAM is write-back
+
+        if ((MPU->CTRL & MPU_CTRL_ENABLE_Msk) == 0)
+          {
+            return cacheable;
+          }
+
+        uint32_t regions = (MPU->TYPE & MPU_TYPE_DREGION_Msk)
+            >> MPU_TYPE_DREGION_Pos;
+
+        rtos::interrupts::critical_section ics;
+
+        for (uint32_t i = 0; i < regions; i++)
+          {
+            MPU->RNR = i;
+            uint32_t rasr = MPU->RASR;
+            if ((rasr & MPU_RASR_ENABLE_Msk) == 0)
+              {
+                continue;
+              }
+
+            uint64_t size = 2ull
+                << ((rasr & MPU_RASR_SIZE_Msk) >> MPU_RASR_SIZE_Pos);
+            uint32_t offset = address - (MPU->RBAR & MPU_RBAR_ADDR_Msk);
+            if (offset >= size)
+              {
+                continue;
+              }
+            if (size >= 256
+                && (rasr >> (MPU_RASR_SRD_Pos + offset / (size / 8))) & 1)
+              {
+                continue;       // disabled sub-region
+              }
+
+            cacheable = rasr_cacheable (rasr);
+          }
+
+        return cacheable;
+      }
+
+      /**
+       * @brief  Check if a whole address range is not cacheable. The range
+       *    must lie in a single sub-region of the MPU region that decides
+       *    its attributes, no higher numbered region may overlap it;
+       *    otherwise, part of it might be cached and it is reported as
+       *    cacheable.
+       * @param  start: first address of the range.
+       * @param  end: last address of the range.
+       * @return true if no byte of the range is cached by the D-cache.
+       */
+      bool
+      qspi_impl::mpu_uncached (uint32_t start, uint32_t end)
+      {
+        if ((MPU->CTRL & MPU_CTRL_ENABLE_Msk) == 0)
+          {
+            return false;       // default memory map, SRAM is write-back
+          }
+
+        uint32_t regions = (MPU->TYPE & MPU_TYPE_DREGION_Msk)
+            >> MPU_TYPE_DREGION_Pos;
+
+        rtos::interrupts::critical_section ics;
+
+        for (uint32_t i = regions; i-- > 0;)
+          {
+            MPU->RNR = i;
+            uint32_t rasr = MPU->RASR;
+            if ((rasr & MPU_RASR_ENABLE_Msk) == 0)
+              {
+                continue;
+              }
+
+            uint64_t size = 2ull
+                << ((rasr & MPU_RASR_SIZE_Msk) >> MPU_RASR_SIZE_Pos);
+            uint64_t base = MPU->RBAR & MPU_RBAR_ADDR_Msk;
+            if (end < base || start >= base + size)
+              {
+                continue;       // no overlap
+              }
+            if (start < base || end >= base + size)
+              {
+                return false;   // partly in this region
+              }
+            if (size >= 256)
+              {
+                uint32_t first = (start - base) / (size / 8);
+                if (first != (end - base) / (size / 8))
+                  {
+                    return false;       // spans several sub-regions
+                  }
+                if ((rasr >> (MPU_RASR_SRD_Pos + first)) & 1)
+                  {
+                    continue;   // disabled sub-region, a lower one decides
+                  }
+              }
+
+            return !rasr_cacheable (rasr);
+          }
+
+        return false;
+      }
+
+      /**
+       * @brief  Decode the cacheability of an MPU region.
+       * @param  rasr: the region's attribute and size register.
+       * @return true if the region is cached by the D-cache.
+       */
+      bool
+      qspi_impl::rasr_cacheable (uint32_t rasr)
+      {
+        // TEX = 1xx: inner policy in C and B, otherwise cached if C
+        uint32_t tex = (rasr & MPU_RASR_TEX_Msk) >> MPU_RASR_TEX_Pos;
+        bool cacheable = (tex & 4) ?
+            (rasr & (MPU_RASR_C_Msk | MPU_RASR_B_Msk)) != 0 :
+            (rasr & MPU_RASR_C_Msk) != 0;
+
+        // shareable memory is not cached, unless forced write-through
+        if ((rasr & MPU_RASR_S_Msk) && (SCB->CACR & SCB_CACR_SIWT_Msk) == 0)
+          {
+            cacheable = false;
+          }
+
+        return cacheable;
+      }
+
+      /**
+       * @brief  Return the counters of the DMA buffer handling paths.
+       * @param  uncached: transfers that needed no cache maintenance.
+       * @param  maintained: transfers with cache maintenance by address.
+       * @param  bounced: reads that went (partially) through the bounce
+       *    buffer.
+       */
+      void
+      qspi_impl::get_dma_stats (uint32_t& uncached, uint32_t& maintained,
+                                uint32_t& bounced)
+      {
+        uncached = dma_uncached_;
+        maintained = dma_maintained_;
+        bounced = dma_bounced_;
+      }
+
+      /**
+       * @brief  Start reading the next chunk of a transfer set-up by read().
+       *    The DMA stream can move at most 65535 items, therefore longer
+       *    transfers are split in chunks, each with its own read command.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::read_chunk (void)
+      {
+        qspi_impl::qspi_result_t result;
+        size_t chunk = xfer_left_;
+
+        if (chunk > DMA_MAX_CHUNK)
+          {
+            chunk = DMA_MAX_CHUNK;
+          }
+
+        result = issue_command (cmd_read, xfer_address_, chunk);
+        if (result == ok)
+          {
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_Receive_DMA (
+                hqspi_, xfer_buff_);
+          }
+
+        xfer_address_ += chunk;
+        xfer_buff_ += chunk;
+        xfer_left_ -= chunk;
+
+        return result;
+      }
+
+      /**
+       * @brief  Receive the data of a read command, copied by the CPU (no
+       *    cache maintenance needed).
+       * @param  buff: buffer where to copy data to.
+       * @param  count: amount of data.
+       * @param  mode: xfer_polled or xfer_it.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::receive (uint8_t* buff, size_t count, transfer_t mode)
+      {
+        qspi_impl::qspi_result_t result;
+
+        if (mode == xfer_polled)
+          {
+            return (qspi_impl::qspi_result_t) HAL_QSPI_Receive (hqspi_, buff,
+                                                                TIMEOUT);
+          }
+
+        result = (qspi_impl::qspi_result_t) HAL_QSPI_Receive_IT (hqspi_, buff);
+        if (result == ok)
+          {
+            result =
+                (semaphore_.timed_wait (transfer_timeout (count))
+                    == rtos::result::ok) ? ok : timeout;
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Transmit the data of a program command, with the strategy
+       *    chosen by size.
+       * @param  buff: source data.
+       * @param  count: amount of data.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::transmit (uint8_t* buff, size_t count)
+      {
+        qspi_impl::qspi_result_t result;
+        transfer_t mode = transfer_mode (count);
+
+        if (mode == xfer_polled)
+          {
+            return (qspi_impl::qspi_result_t) HAL_QSPI_Transmit (hqspi_, buff,
+                                                                 TIMEOUT);
+          }
+
+        if (mode == xfer_it)
+          {
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_Transmit_IT (hqspi_,
+                                                                      buff);
+          }
+        else
+          {
+            /**
+             *  Clean the data cache to mitigate incoherence before DMA
+             *  transfers; cleaning lines shared with other data is
+             *  harmless, therefore no bounce buffer is needed
+             */
+            if (dma_buffer (buff, count) == dma_uncached)
+              {
+                dma_uncached_++;
+              }
+            else
+              {
+                dma_maintained_++;
+                clean_dcache (buff, count);
+              }
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_Transmit_DMA (hqspi_,
+                                                                       buff);
+          }
+
+        if (result == ok)
+          {
+            result =
+                (semaphore_.timed_wait (TIMEOUT) == rtos::result::ok) ?
+                    ok : timeout;
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Set the transfer size thresholds from measured costs. Each
+       *    strategy reads CALIBRATE_SMALL and CALIBRATE_LARGE bytes, which
+       *    gives its fixed cost and its cost per byte. Polling is used as
+       *    long as the transfer takes less than the fixed cost of the
+       *    cheapest other strategy (the time the CPU would spend anyway);
+       *    interrupts are used up to the size where DMA gets faster.
+       */
+      void
+      qspi_impl::calibrate_transfers (void)
+      {
+        static constexpr uint32_t sizes[2] =
+          { CALIBRATE_SMALL, CALIBRATE_LARGE };
+        uint8_t* buff = (uint8_t*) (((uint32_t) bounce_buff_ + CACHE_LINE - 1)
+            & ~(CACHE_LINE - 1));
+        int64_t cycles[3][2] =
+          { };
+
+        // Two passes, the first one warms up the caches; the data is not
+        // used, therefore the DMA reads need no cache maintenance
+        for (int pass = 0; pass < 2; pass++)
+          {
+            for (int mode = xfer_polled; mode <= xfer_dma; mode++)
+              {
+                for (int i = 0; i < 2; i++)
+                  {
+                    rtos::clock::timestamp_t start = rtos::hrclock.now ();
+                    if (mode == xfer_dma)
+                      {
+                        read_dma (0, buff, sizes[i]);
+                      }
+                    else if (issue_command (cmd_read, 0, sizes[i]) == ok)
+                      {
+                        receive (buff, sizes[i], (transfer_t) mode);
+                      }
+                    cycles[mode][i] = rtos::hrclock.now () - start;
+                  }
+              }
+          }
+
+        // Linear model of each strategy: fixed + per byte (x16) cost
+        int64_t fixed[3], per_byte[3];
+        for (int mode = xfer_polled; mode <= xfer_dma; mode++)
+          {
+            per_byte[mode] = (cycles[mode][1] - cycles[mode][0]) * 16
+                / (CALIBRATE_LARGE - CALIBRATE_SMALL);
+            fixed[mode] = cycles[mode][0]
+                - per_byte[mode] * CALIBRATE_SMALL / 16;
+          }
+
+        int64_t polling = 0;
+        if (per_byte[xfer_polled] > 0)
+          {
+            int64_t cheapest =
+                (fixed[xfer_it] < fixed[xfer_dma]) ?
+                    fixed[xfer_it] : fixed[xfer_dma];
+            polling = cheapest * 16 / per_byte[xfer_polled];
+          }
+        polling = (polling < 0) ? 0 :
+                  (polling > TRANSFER_LIMIT) ? TRANSFER_LIMIT : polling;
+
+        int64_t it = polling;
+        if (per_byte[xfer_it] > per_byte[xfer_dma]
+            && fixed[xfer_dma] > fixed[xfer_it])
+          {
+            it = (fixed[xfer_dma] - fixed[xfer_it]) * 16
+                / (per_byte[xfer_it] - per_byte[xfer_dma]);
+          }
+        it = (it < polling) ? polling : (it > TRANSFER_LIMIT) ?
+            TRANSFER_LIMIT : it;
+
+        polling_max_ = (uint32_t) polling;
+        it_max_ = (uint32_t) it;
+      }
+
+      /**
+       * @brief  Compute the timeout of a data transfer, from its size and the
+       *    clock of the QSPI bus (two clock cycles per byte in quad mode),
+       *    with a 100% margin.
+       * @param  count: number of bytes to transfer.
+       * @return The timeout in ticks.
+       */
+      uint32_t
+      qspi_impl::transfer_timeout (size_t count)
+      {
+        uint32_t clock = HAL_RCC_GetHCLKFreq ()
+            / (hqspi_->Init.ClockPrescaler + 1);
+        uint32_t ms = (uint32_t) (((uint64_t) count * 2 * 2 * 1000) / clock);
+
+        return TIMEOUT + ms * one_ms;
+      }
+
+      /**
+       * @brief  Write data to flash.
+       * @param  address: start address in flash where to write data to.
+       * @param  buff: source data to be written.
+       * @param  count: amount of data to be written.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::write (uint32_t address, uint8_t* buff, size_t count)
+      {
+        qspi_impl::qspi_result_t result = error;
+        size_t in_block_count;
+        size_t page = page_size ();
+
+        if (pdevice_ != nullptr && ((address | count) & (chips_ - 1)) == 0)
+          {
+            do
+              {
+                in_block_count = page - (address & (page - 1));
+                if (in_block_count > count)
+                  {
+                    in_block_count = count;
+                  }
+                if ((result = page_write (address, buff, in_block_count)) != ok)
+                  {
+                    break;
+                  }
+                address += in_block_count;
+                buff += in_block_count;
+                count -= in_block_count;
+              }
+            while (count > 0);
+          }
+
         return result;
       }
 
       /**
-       * @brief  Map the flash to the addressing space of the controller, starting at
-       * 	address 0x90000000.
-       * @return qspi::ok if successful, false otherwise.
+       * @brief  Write data to a freshly erased area of the flash. The pages
+       *    whose new content is all 0xFF are already in the right state after
+       *    the erase, therefore they are skipped.
+       * @param  address: start address in flash where to write data to.
+       * @param  buff: source data to be written.
+       * @param  count: amount of data to be written.
+       * @return qspi::ok if successful, a qspi error otherwise.
        */
       qspi_impl::qspi_result_t
-      qspi_impl::enter_mem_mapped (void)
+      qspi_impl::write_erased (uint32_t address, uint8_t* buff, size_t count)
+      {
+        qspi_impl::qspi_result_t result = ok;
+        size_t in_page_count;
+        size_t page = page_size ();
+
+        while (count > 0 && result == ok)
+          {
+            in_page_count = page - (address & (page - 1));
+            if (in_page_count > count)
+              {
+                in_page_count = count;
+              }
+
+            if (qspi_kernels::all_ones (buff, in_page_count) == false)
+              {
+                // page has data to be programmed
+                result = page_write (address, buff, in_page_count);
+              }
+            address += in_page_count;
+            buff += in_page_count;
+            count -= in_page_count;
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Write a page of data to the flash (max. 256 bytes).
+       * @param  address: address of the page in flash.
+       * @param  buff: buffer of the source data.
+       * @param  count: number of bytes to be written (max 256).
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::page_write (uint32_t address, uint8_t* buff, size_t count)
+      {
+        qspi_impl::qspi_result_t result = error;
+
+        if (erase_busy_ && !erase_suspended_)
+          {
+            // An erase started with start_erase() is not finished yet
+            return busy;
+          }
+
+        // The sector is no longer erased, whatever the outcome
+        set_blank (address, count, false);
+
+        // Enable write
+        result = issue_command (cmd_write_enable, 0, 0);
+        if (result == ok)
+          {
+            // Initiate write
+            result = issue_command (cmd_page_program, address, count);
+            if (result == ok)
+              {
+                result = transmit (buff, count);
+                if (result == ok)
+                  {
+                    // Let the program run for its typical time, then set
+                    // auto-polling and wait for the event
+                    sleep_typical (PAGE_PROGRAM);
+                    result = poll_ready (false, poll_interval (PAGE_PROGRAM));
+                    if (result == ok)
+                      {
+                        result =
+                            (semaphore_.timed_wait (
+                                operation_timeout (PAGE_PROGRAM))
+                                == rtos::result::ok) ? ok : timeout;
+                      }
+                  }
+              }
+          }
+
+        // Drop the cached copies of the mapped window only now: a
+        // speculative access during the program would have refilled them
+        // with the old content. Done whatever the outcome, the page may be
+        // partially programmed.
+        invalidate_window (address, count);
+        read_ahead_drop (address, count);
+
+        return result;
+      }
+
+      /**
+       * @brief  Erase a sector (4K), block (32K), large block (64K) or whole flash.
+       * @param  address: address of the block to be erased.
+       * @param  which: command to erase, can be either SECTOR_ERASE, BLOCK_32K_ERASE,
+       * 	BLOCK_64K_ERASE or CHIP_ERASE.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::erase (uint32_t address, uint8_t which)
+      {
+        qspi_impl::qspi_result_t result;
+
+        result = start_erase (address, (erase_kind_t) which, true);
+        if (result == ok)
+          {
+            // Status polling starts after the typical erase time, unless a
+            // read suspended the erase meanwhile
+            bool arm;
+
+            sleep_typical (which);
+              {
+                rtos::interrupts::critical_section ics;
+
+                arm = erase_deferred_;
+                erase_deferred_ = false;
+                erase_polling_ = erase_polling_ || arm;
+              }
+            if (arm && poll_ready (false, poll_interval (which)) != ok)
+              {
+                result = error;
+              }
+            else
+              {
+                result = wait_erase (operation_timeout (which));
+              }
+            if (result != ok)
+              {
+                // Stop auto-polling, a late status match must not be taken
+                // as the end of the next transfer
+                erase_polling_ = false;
+                HAL_QSPI_Abort (hqspi_);
+                semaphore_.reset ();
+                erase_busy_ = false;
+              }
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Start an erase operation and return as soon as the flash has
+       *    accepted the command. The end of the erase is checked with
+       *    erase_status() or waited for with wait_erase().
+       * @param  address: an address in the sector/block to erase (ignored for
+       *    a chip erase).
+       * @param  kind: erase kind (sector, 32K block, 64K block or chip).
+       * @return qspi::ok if the erase was started, qspi::busy if another
+       *    erase is in progress, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::start_erase (uint32_t address, erase_kind_t kind)
+      {
+        return start_erase (address, kind, false);
+      }
+
+      /**
+       * @brief  Start an erase operation.
+       * @param  address: an address in the sector/block to erase.
+       * @param  kind: erase kind (sector, 32K block, 64K block or chip).
+       * @param  deferred: if true, the status polling is not set, the caller
+       *    sets it later (after the typical erase time).
+       * @return qspi::ok if the erase was started, qspi::busy if another
+       *    erase is in progress, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::start_erase (uint32_t address, erase_kind_t kind,
+                              bool deferred)
       {
         qspi_impl::qspi_result_t result = error;
+        command_id_t id;
+
+        if (erase_busy_)
+          {
+            return busy;
+          }
+
+        switch (kind)
+          {
+          case erase_kind_sector:
+            id = cmd_erase_sector;
+            break;
+          case erase_kind_block32K:
+            id = cmd_erase_block32K;
+            break;
+          case erase_kind_block64K:
+            id = cmd_erase_block64K;
+            break;
+          case erase_kind_chip:
+            id = cmd_erase_chip;
+            break;
+          default:
+            return error;
+          }
+
+        if (pdevice_ != nullptr)
+          {
+            // Enable write
+            result = issue_command (cmd_write_enable, 0, 0);
+            if (result == ok)
+              {
+                // Initiate erase
+                result = issue_command (id, address, 0);
+                if (result == ok)
+                  {
+                    /*
+                     * Set auto-polling, the end is signaled by cb_event();
+                     * meanwhile, read() calls may suspend the erase.
+                     */
+                    erase_address_ = address;
+                    erase_which_ = kind;
+                    erase_sem_.reset ();
+                    erase_done_ = false;
+                    erase_busy_ = true;
+                    erase_deferred_ = deferred;
+                    erase_polling_ = !deferred;
+                    if (!deferred)
+                      {
+                        result = poll_ready (false, poll_interval (kind));
+                        if (result != ok)
+                          {
+                            erase_polling_ = false;
+                            HAL_QSPI_Abort (hqspi_);
+                            semaphore_.reset ();
+                            erase_busy_ = false;
+                          }
+                      }
+                  }
+              }
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Check the state of an erase started with start_erase().
+       * @return qspi::ok if no erase is in progress (i.e. it finished),
+       *    qspi::busy if the erase is still in progress.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::erase_status (void)
+      {
+        if (erase_busy_ && erase_done_)
+          {
+            erase_finish ();
+          }
+
+        return erase_busy_ ? busy : ok;
+      }
+
+      /**
+       * @brief  Wait for the end of an erase started with start_erase().
+       * @param  timeout: maximum time to wait, in ticks.
+       * @return qspi::ok if the erase finished (or none was in progress),
+       *    qspi::timeout if it is still in progress.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::wait_erase (os::rtos::clock::duration_t timeout)
+      {
+        if (erase_busy_)
+          {
+            if (erase_done_
+                || erase_sem_.timed_wait (timeout) == rtos::result::ok)
+              {
+                // Another thread may wait for the same erase (e.g. a read
+                // on a device that cannot suspend it); the next erase
+                // resets the semaphore
+                erase_done_ = true;
+                erase_sem_.post ();
+                erase_finish ();
+              }
+            else
+              {
+                return qspi_impl::timeout;
+              }
+          }
+
+        return ok;
+      }
+
+      /**
+       * @brief  Write data to flash while an erase started with start_erase()
+       *    may be in progress: the erase is suspended for the time of the
+       *    programs, then resumed. The data must not be in the area being
+       *    erased.
+       * @param  address: start address in flash where to write data to.
+       * @param  buff: source data to be written.
+       * @param  count: amount of data to be written.
+       * @return qspi::ok if successful, qspi::busy if the device cannot
+       *    suspend an erase, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::write_during_erase (uint32_t address, uint8_t* buff,
+                                     size_t count)
+      {
+        qspi_impl::qspi_result_t result;
+        bool suspended = false;
+
+        if (erase_status () == ok)
+          {
+            // No erase in progress (any more)
+            return write (address, buff, count);
+          }
+
+        result = suspend_erase (suspended);
+        if (result == ok)
+          {
+            erase_suspended_ = true;
+            result = write (address, buff, count);
+            erase_suspended_ = false;
+          }
+        if (suspended)
+          {
+            qspi_impl::qspi_result_t res = resume_erase ();
+            result = (result == ok) ? res : result;
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  End an erase operation: keep the map of erased sectors up to
+       *    date and release the flash for other operations.
+       */
+      void
+      qspi_impl::erase_finish (void)
+      {
+        uint32_t address = erase_address_;
+        size_t size = get_sector_size ();
+
+        if (erase_which_ == CHIP_ERASE)
+          {
+            address = 0;
+            size *= get_sector_count ();
+          }
+        else if (erase_which_ == BLOCK_64K_ERASE)
+          {
+            size = BLOCK_64K_SIZE * chips_;
+          }
+        else if (erase_which_ == BLOCK_32K_ERASE)
+          {
+            size = BLOCK_32K_SIZE * chips_;
+          }
+        address &= ~(size - 1);
+        set_blank (address, size, true);
+        invalidate_window (address, size);
+        read_ahead_drop (address, size);
+        if (block_logical_size_bytes_ != 0)
+          {
+            set_trimmed (address / block_logical_size_bytes_,
+                         size / block_logical_size_bytes_, false);
+          }
+
+        erase_busy_ = false;
+      }
+
+      /**
+       * @brief  Auto-poll the status register until the flash is ready (WIP
+       *    bit cleared).
+       * @param  wait: if true, wait here for the flash to become ready; if
+       *    false, the end of polling is signaled through cb_event().
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::poll_ready (bool wait, uint32_t interval)
+      {
         QSPI_CommandTypeDef sCommand;
-        QSPI_MemoryMappedTypeDef sMemMappedCfg;
+        QSPI_AutoPollingTypeDef sConfig;
+
+        sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
+        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
+        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
+        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
+        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
+        sCommand.InstructionMode = QSPI_INSTRUCTION_4_LINES;
+        sCommand.AddressMode = QSPI_ADDRESS_NONE;
+        sCommand.DataMode = QSPI_DATA_4_LINES;
+        sCommand.DummyCycles = 0;
+        sCommand.Instruction = READ_STATUS_REGISTER;
+
+        // In dual-flash mode, the status bytes of both chips are checked
+        sConfig.Match = 0;
+        sConfig.Mask = (chips_ > 1) ? 0x0101 : 0x01;
+        sConfig.MatchMode = QSPI_MATCH_MODE_AND;
+        sConfig.StatusBytesSize = chips_;
+        sConfig.Interval = interval;
+        sConfig.AutomaticStop = QSPI_AUTOMATIC_STOP_ENABLE;
+
+        exit_mem_mapped ();
+        return (qspi_impl::qspi_result_t) (
+            wait ? HAL_QSPI_AutoPolling (hqspi_, &sCommand, &sConfig, TIMEOUT) :
+                HAL_QSPI_AutoPolling_IT (hqspi_, &sCommand, &sConfig));
+      }
+
+      /**
+       * @brief  Return the typical and maximum times of a program or erase
+       *    operation, from the device description.
+       * @param  which: PAGE_PROGRAM or an erase command.
+       * @param  typical: returns the typical time, in us (0 if unknown).
+       * @param  max: returns the maximum time, in us (0 if unknown).
+       */
+      void
+      qspi_impl::operation_times (uint8_t which, uint32_t& typical,
+                                  uint32_t& max)
+      {
+        const qspi_timing_t& t = pdevice_->timing;
 
-        if (pdevice_ != nullptr)
+        switch (which)
           {
-            sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
-            sCommand.AlternateByteMode = pdevice_->alt_bytes_mode;
-            sCommand.AlternateBytesSize = pdevice_->alt_bytes_size;
-            sCommand.AlternateBytes = pdevice_->alt_bytes;
-            sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
-            sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
-            sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
-            sCommand.InstructionMode = QSPI_INSTRUCTION_4_LINES;
-            sCommand.AddressMode = QSPI_ADDRESS_4_LINES;
-            sCommand.DataMode = QSPI_DATA_4_LINES;
-            sCommand.DummyCycles = pdevice_->dummy_cycles
-                - pdevice_->alt_bytes_cycles;
-            sCommand.Instruction = FAST_READ_QUAD_IN_OUT;
+          case PAGE_PROGRAM:
+            typical = t.program_typ;
+            max = t.program_max;
+            break;
+          case SECTOR_ERASE:
+            typical = t.erase_4K_typ * 1000;
+            max = t.erase_4K_max * 1000;
+            break;
+          case BLOCK_32K_ERASE:
+            typical = t.erase_32K_typ * 1000;
+            max = t.erase_32K_max * 1000;
+            break;
+          case BLOCK_64K_ERASE:
+            typical = t.erase_64K_typ * 1000;
+            max = t.erase_64K_max * 1000;
+            break;
+          case CHIP_ERASE:
+            typical = t.chip_erase_typ * 1000000;
+            max = t.chip_erase_max * 1000000;
+            break;
+          default:
+            typical = max = 0;
+            break;
+          }
+      }
 
-            sMemMappedCfg.TimeOutActivation = QSPI_TIMEOUT_COUNTER_DISABLE;
+      /**
+       * @brief  Compute the timeout of a program or erase operation: its
+       *    maximum time plus a margin, or the default timeout if the device
+       *    description gives no times.
+       * @param  which: PAGE_PROGRAM or an erase command.
+       * @return The timeout in ticks.
+       */
+      os::rtos::clock::duration_t
+      qspi_impl::operation_timeout (uint8_t which)
+      {
+        uint32_t typical, max;
 
-            result = (qspi_impl::qspi_result_t) HAL_QSPI_MemoryMapped (
-                hqspi_, &sCommand, &sMemMappedCfg);
+        operation_times (which, typical, max);
+        if (max == 0)
+          {
+            return (which == PAGE_PROGRAM) ? WRITE_TIMEOUT :
+                   (which == CHIP_ERASE) ? CHIP_ERASE_TIMEOUT : ERASE_TIMEOUT;
           }
 
-        return result;
+        return TIMEOUT
+            + (os::rtos::clock::duration_t) (((uint64_t) max
+                * rtos::sysclock.frequency_hz) / 1000000);
       }
 
       /**
-       * @brief  Read a block of data from the flash.
-       * @param  address: start address in flash where to read from.
-       * @param  buff: buffer where to copy data to.
-       * @param  count: amount of data to be retrieved from flash.
-       * @return qspi::ok if successful, a qspi error otherwise.
+       * @brief  Compute the status polling interval of a program or erase
+       *    operation, so that the status is read a few times per typical
+       *    operation time at the current QSPI clock.
+       * @param  which: PAGE_PROGRAM or an erase command.
+       * @return The interval in QSPI clock cycles.
        */
-      qspi_impl::qspi_result_t
-      qspi_impl::read (uint32_t address, uint8_t* buff, size_t count)
+      uint32_t
+      qspi_impl::poll_interval (uint8_t which)
       {
-        qspi_impl::qspi_result_t result = error;
-        QSPI_CommandTypeDef sCommand;
-
-        if (pdevice_ != nullptr)
-          {
-            // Read command settings
-            sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
-            sCommand.AlternateByteMode = pdevice_->alt_bytes_mode;
-            sCommand.AlternateBytesSize = pdevice_->alt_bytes_size;
-            sCommand.AlternateBytes = pdevice_->alt_bytes;
-            sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
-            sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
-            sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
-            sCommand.InstructionMode = QSPI_INSTRUCTION_4_LINES;
-            sCommand.AddressMode = QSPI_ADDRESS_4_LINES;
-            sCommand.DataMode = QSPI_DATA_4_LINES;
-            sCommand.DummyCycles = pdevice_->dummy_cycles
-                - pdevice_->alt_bytes_cycles;
-            sCommand.Address = address;
-            sCommand.NbData = count;
-            sCommand.Instruction = FAST_READ_QUAD_IN_OUT;
+        uint32_t typical, max;
 
-            // Initiate read, then wait for the event
-            result = qspi_command (hqspi_, &sCommand, TIMEOUT);
-            if (result == ok)
-              {
-                /**
-                 * Flush and clean the data cache to mitigate incoherence before
-                 * a DMA transfer (DTCM RAM is not cached)
-                 */
-                if ((buff + count) >= (uint8_t*) SRAM1_BASE)
-                  {
-                    invalidate_dcache (buff, count);
-                  }
-                result = (qspi_impl::qspi_result_t) HAL_QSPI_Receive_DMA (
-                    hqspi_, buff);
-                if (result == ok)
-                  {
-                    result =
-                        (semaphore_.timed_wait (TIMEOUT) == rtos::result::ok) ?
-                            ok : timeout;
-                  }
-              }
-          }
+        operation_times (which, typical, max);
+        uint64_t cycles = ((uint64_t) typical * (clock_hz_ / 1000000))
+            / POLLS_PER_OPERATION;
 
-        return result;
+        return (cycles < POLL_INTERVAL) ? POLL_INTERVAL :
+               (cycles > 0xFFFF) ? 0xFFFF : (uint32_t) cycles;
       }
 
       /**
-       * @brief  Write data to flash.
-       * @param  address: start address in flash where to write data to.
-       * @param  buff: source data to be written.
-       * @param  count: amount of data to be written.
-       * @return qspi::ok if successful, a qspi error otherwise.
+       * @brief  Sleep the calling thread for the typical time of a program
+       *    or erase operation (in whole ticks, shorter times are not slept).
+       * @param  which: PAGE_PROGRAM or an erase command.
        */
-      qspi_impl::qspi_result_t
-      qspi_impl::write (uint32_t address, uint8_t* buff, size_t count)
+      void
+      qspi_impl::sleep_typical (uint8_t which)
       {
-        qspi_impl::qspi_result_t result = error;
-        size_t in_block_count;
+        uint32_t typical, max;
 
-        if (pdevice_ != nullptr)
+        operation_times (which, typical, max);
+        os::rtos::clock::duration_t ticks =
+            (os::rtos::clock::duration_t) (((uint64_t) typical
+                * rtos::sysclock.frequency_hz) / 1000000);
+        if (ticks > 0)
           {
-            do
-              {
-                in_block_count = 0x100 - (address & 0xFF);
-                if (in_block_count > count)
-                  {
-                    in_block_count = count;
-                  }
-                else if (in_block_count == 0)
-                  {
-                    in_block_count = (count > 0x100) ? 0x100 : count;
-                  }
-                if ((result = page_write (address, buff, in_block_count)) != ok)
-                  {
-                    break;
-                  }
-                address += in_block_count;
-                buff += in_block_count;
-                count -= in_block_count;
-              }
-            while (count > 0);
+            rtos::sysclock.sleep_for (ticks);
           }
-
-        return result;
       }
 
       /**
-       * @brief  Write a page of data to the flash (max. 256 bytes).
-       * @param  address: address of the page in flash.
-       * @param  buff: buffer of the source data.
-       * @param  count: number of bytes to be written (max 256).
-       * @return qspi::ok if successful, a qspi error otherwise.
+       * @brief  Read a status register of the flash.
+       * @param  instruction: the read register command.
+       * @param  value: returns the register's value.
+       * @return qspi::ok if successful, or a qspi error otherwise.
        */
       qspi_impl::qspi_result_t
-      qspi_impl::page_write (uint32_t address, uint8_t* buff, size_t count)
+      qspi_impl::read_register (uint8_t instruction, uint8_t& value)
       {
-        qspi_impl::qspi_result_t result = error;
+        qspi_impl::qspi_result_t result;
         QSPI_CommandTypeDef sCommand;
-        QSPI_AutoPollingTypeDef sConfig;
+        uint8_t values[2] =
+          { };
 
-        // Initial command settings
         sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
         sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
         sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
@@ -600,85 +2734,119 @@ namespace os
         sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
         sCommand.InstructionMode = QSPI_INSTRUCTION_4_LINES;
         sCommand.AddressMode = QSPI_ADDRESS_NONE;
-        sCommand.DataMode = QSPI_DATA_NONE;
+        sCommand.DataMode = QSPI_DATA_4_LINES;
         sCommand.DummyCycles = 0;
+        sCommand.NbData = chips_;
+        sCommand.Instruction = instruction;
 
-        // Enable write
-        sCommand.Instruction = WRITE_ENABLE;
         result = qspi_command (hqspi_, &sCommand, TIMEOUT);
         if (result == ok)
           {
-            // Initiate write
-            sCommand.Instruction = PAGE_PROGRAM;
-            sCommand.AddressMode = QSPI_ADDRESS_4_LINES;
-            sCommand.DataMode = QSPI_DATA_4_LINES;
-            sCommand.Address = address;
-            sCommand.NbData = count;
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_Receive (hqspi_,
+                                                                  values,
+                                                                  TIMEOUT);
+          }
+        value = values[0] | values[1];
+
+        return result;
+      }
+
+      /**
+       * @brief  Send the data byte of a register write command, once to
+       *    each chip (the command must be set-up for chips_ data bytes).
+       * @param  value: the register value.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::transmit_register (uint8_t value)
+      {
+        uint8_t values[2] =
+          { value, value };
+
+        return (qspi_impl::qspi_result_t) HAL_QSPI_Transmit (hqspi_, values,
+                                                             TIMEOUT);
+      }
+
+      /**
+       * @brief  Suspend an erase in progress, to let a read through. The
+       *    suspend latency of the flash is at most a few tens of us.
+       * @param  suspended: returns true if the erase was suspended and must
+       *    be resumed, false if it was already finished.
+       * @return qspi::ok if successful, qspi::busy if the device cannot
+       *    suspend an erase (the erase is left as it was), or a qspi error
+       *    otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::suspend_erase (bool& suspended)
+      {
+        qspi_impl::qspi_result_t result = ok;
+        QSPI_CommandTypeDef sCommand;
+        bool polling;
+
+        suspended = false;
+          {
+            rtos::interrupts::critical_section ics;
+
+            polling = erase_polling_ || erase_deferred_;
+            if (polling && pimpl != nullptr && pimpl->suspend_command == 0)
+              {
+                // The device cannot suspend an erase, the caller must wait
+                // for its end; the erase is left exactly as it was
+                return busy;
+              }
+
+            // An erase waiting for its typical time is suspended as well,
+            // its polling is set by the resume
+            erase_polling_ = false;
+            erase_deferred_ = false;
+          }
+
+        if (polling && pimpl != nullptr)
+          {
+            // Stop auto-polling, a late status match must not be taken as
+            // the end of the read
+            HAL_QSPI_Abort (hqspi_);
+            semaphore_.reset ();
+
+            sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
+            sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
+            sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
+            sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
+            sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
+            sCommand.InstructionMode = QSPI_INSTRUCTION_4_LINES;
+            sCommand.AddressMode = QSPI_ADDRESS_NONE;
+            sCommand.DataMode = QSPI_DATA_NONE;
+            sCommand.DummyCycles = 0;
+            sCommand.Instruction = pimpl->suspend_command;
+
             result = qspi_command (hqspi_, &sCommand, TIMEOUT);
             if (result == ok)
               {
-                /**
-                 *  Clean the data cache to mitigate incoherence before DMA transfers
-                 *  (DTCM RAM is not cached)
-                 */
-                if ((buff + count) >= (uint8_t*) SRAM1_BASE)
-                  {
-                    clean_dcache (buff, count);
-                  }
-                result = (qspi_impl::qspi_result_t) HAL_QSPI_Transmit_DMA (
-                    hqspi_, buff);
-                if (result == ok)
-                  {
-                    if (semaphore_.timed_wait (TIMEOUT) == rtos::result::ok)
-                      {
-                        // Set auto-polling and wait for the event
-                        sCommand.AddressMode = QSPI_ADDRESS_NONE;
-                        sCommand.DataMode = QSPI_DATA_4_LINES;
-                        sCommand.Instruction = READ_STATUS_REGISTER;
-                        sConfig.Match = 0;
-                        sConfig.Mask = 1;
-                        sConfig.MatchMode = QSPI_MATCH_MODE_AND;
-                        sConfig.StatusBytesSize = 1;
-                        sConfig.Interval = 0x10;
-                        sConfig.AutomaticStop = QSPI_AUTOMATIC_STOP_ENABLE;
-                        result =
-                            (qspi_impl::qspi_result_t) HAL_QSPI_AutoPolling_IT (
-                                hqspi_, &sCommand, &sConfig);
-                        if (result == ok)
-                          {
-                            result =
-                                (semaphore_.timed_wait (WRITE_TIMEOUT)
-                                    == rtos::result::ok) ? ok : timeout;
-                          }
-                      }
-                    else
-                      {
-                        result = timeout;
-                      }
-                  }
+                // The flash is ready when suspended (or if already done)
+                result = poll_ready (true);
               }
+            suspended = true;
           }
 
         return result;
       }
 
       /**
-       * @brief  Erase a sector (4K), block (32K), large block (64K) or whole flash.
-       * @param  address: address of the block to be erased.
-       * @param  which: command to erase, can be either SECTOR_ERASE, BLOCK_32K_ERASE,
-       * 	BLOCK_64K_ERASE or CHIP_ERASE.
+       * @brief  Resume a suspended erase, if the flash reports it as
+       *    suspended, and set auto-polling back for its end (also after a
+       *    failed suspend).
        * @return qspi::ok if successful, or a qspi error otherwise.
        */
       qspi_impl::qspi_result_t
-      qspi_impl::erase (uint32_t address, uint8_t which)
+      qspi_impl::resume_erase (void)
       {
-        qspi_impl::qspi_result_t result = error;
+        qspi_impl::qspi_result_t result;
         QSPI_CommandTypeDef sCommand;
-        QSPI_AutoPollingTypeDef sConfig;
+        bool suspended;
 
-        if (pdevice_ != nullptr)
+        result = pimpl->is_suspended (this, suspended);
+        if (result == ok && suspended)
           {
-            // Initial command settings
             sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
             sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
             sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
@@ -688,45 +2856,16 @@ namespace os
             sCommand.AddressMode = QSPI_ADDRESS_NONE;
             sCommand.DataMode = QSPI_DATA_NONE;
             sCommand.DummyCycles = 0;
+            sCommand.Instruction = pimpl->resume_command;
 
-            // Enable write
-            sCommand.Instruction = WRITE_ENABLE;
             result = qspi_command (hqspi_, &sCommand, TIMEOUT);
-            if (result == ok)
-              {
-                // Initiate erase
-                sCommand.Instruction = which;
-                sCommand.AddressMode =
-                    (which == CHIP_ERASE) ? QSPI_ADDRESS_NONE : //
-                        QSPI_ADDRESS_4_LINES;
-                sCommand.DataMode = QSPI_DATA_NONE;
-                sCommand.Address = address;
-                result = qspi_command (hqspi_, &sCommand, TIMEOUT);
-                if (result == ok)
-                  {
-                    // Set auto-polling and wait for the event
-                    sCommand.Instruction = READ_STATUS_REGISTER;
-                    sCommand.AddressMode = QSPI_ADDRESS_NONE;
-                    sCommand.DataMode = QSPI_DATA_4_LINES;
-                    sConfig.Match = 0;
-                    sConfig.Mask = 1;
-                    sConfig.MatchMode = QSPI_MATCH_MODE_AND;
-                    sConfig.StatusBytesSize = 1;
-                    sConfig.Interval = 0x10;
-                    sConfig.AutomaticStop = QSPI_AUTOMATIC_STOP_ENABLE;
-                    result =
-                        (qspi_impl::qspi_result_t) HAL_QSPI_AutoPolling_IT (
-                            hqspi_, &sCommand, &sConfig);
-                    if (result == ok)
-                      {
-                        result =
-                            (semaphore_.timed_wait (
-                                (which == CHIP_ERASE) ? CHIP_ERASE_TIMEOUT : //
-                                    ERASE_TIMEOUT) == rtos::result::ok) ?
-                                ok : timeout;
-                      }
-                  }
-              }
+          }
+        if (result == ok)
+          {
+            // If the erase finished before the suspend took effect, or the
+            // suspend failed, the polling reports the end as well
+            erase_polling_ = true;
+            result = poll_ready (false, poll_interval (erase_which_));
           }
 
         return result;
@@ -742,7 +2881,7 @@ namespace os
       qspi_impl::qspi_result_t
       qspi_impl::read_sector (uint32_t sector, uint8_t* buff, size_t count)
       {
-        return read (sector * pdevice_->sector_size, buff, count);
+        return read (sector * get_sector_size (), buff, count);
       }
 
       /**
@@ -755,7 +2894,7 @@ namespace os
       qspi_impl::qspi_result_t
       qspi_impl::write_sector (uint32_t sector, uint8_t* buff, size_t count)
       {
-        return write (sector * pdevice_->sector_size, buff, count);
+        return write (sector * get_sector_size (), buff, count);
       }
 
       /**
@@ -766,7 +2905,54 @@ namespace os
       qspi_impl::qspi_result_t
       qspi_impl::erase_sector (uint32_t sector)
       {
-        return erase (sector * pdevice_->sector_size, SECTOR_ERASE);
+        return erase (sector * get_sector_size (), SECTOR_ERASE);
+      }
+
+      /**
+       * @brief  Erase a range of the flash using the fewest erase commands,
+       *    i.e. 64K blocks and 32K blocks wherever the range is aligned to
+       *    them and sectors for the rest.
+       * @param  address: start address of the range (must be sector aligned).
+       * @param  length: length of the range in bytes (must be a multiple of
+       *    the sector size).
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::erase_range (uint32_t address, size_t length)
+      {
+        qspi_impl::qspi_result_t result = error;
+
+        size_t sector_size = get_sector_size ();
+        size_t block64K = BLOCK_64K_SIZE * chips_;
+        size_t block32K = BLOCK_32K_SIZE * chips_;
+
+        if (pdevice_ != nullptr && (address % sector_size) == 0
+            && (length % sector_size) == 0)
+          {
+            result = ok;
+            while (length > 0 && result == ok)
+              {
+                uint8_t which = SECTOR_ERASE;
+                size_t size = sector_size;
+
+                if ((address % block64K) == 0 && length >= block64K)
+                  {
+                    which = BLOCK_64K_ERASE;
+                    size = block64K;
+                  }
+                else if ((address % block32K) == 0 && length >= block32K)
+                  {
+                    which = BLOCK_32K_ERASE;
+                    size = block32K;
+                  }
+
+                result = erase (address, which);
+                address += size;
+                length -= size;
+              }
+          }
+
+        return result;
       }
 
       /**
@@ -803,12 +2989,177 @@ namespace os
         return result;
       }
 
+      /**
+       * @brief  Pre-compute the descriptors of the frequent commands, for
+       *    the current device and read mode.
+       */
+      void
+      qspi_impl::build_commands (void)
+      {
+        static const struct
+        {
+          uint8_t instruction;
+          uint8_t instruction_4B;
+          uint32_t address_mode;
+          uint32_t data_mode;
+        } list[cmd_count] =
+          {
+            { FAST_READ_QUAD_IN_OUT, 0, 0, 0 }, // set-up by read_command()
+            { WRITE_ENABLE, WRITE_ENABLE, QSPI_ADDRESS_NONE, QSPI_DATA_NONE },
+            { PAGE_PROGRAM, PAGE_PROGRAM_4B, QSPI_ADDRESS_4_LINES,
+            QSPI_DATA_4_LINES },
+            { SECTOR_ERASE, SECTOR_ERASE_4B, QSPI_ADDRESS_4_LINES,
+            QSPI_DATA_NONE },
+            { BLOCK_32K_ERASE, BLOCK_32K_ERASE_4B, QSPI_ADDRESS_4_LINES,
+            QSPI_DATA_NONE },
+            { BLOCK_64K_ERASE, BLOCK_64K_ERASE_4B, QSPI_ADDRESS_4_LINES,
+            QSPI_DATA_NONE },
+            { CHIP_ERASE, CHIP_ERASE, QSPI_ADDRESS_NONE, QSPI_DATA_NONE }, //
+          };
+        bool opcodes_4B = address_4B_
+            && pdevice_->address_mode == ADDRESS_4B_OPCODES;
+
+        for (int i = 0; i < cmd_count; i++)
+          {
+            QSPI_CommandTypeDef& cmd = commands_[i].hal;
+
+            if (i == cmd_read)
+              {
+                read_command (cmd);
+              }
+            else
+              {
+                cmd.AddressSize = address_size ();
+                cmd.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
+                cmd.AlternateBytesSize = QSPI_ALTERNATE_BYTES_8_BITS;
+                cmd.AlternateBytes = 0;
+                cmd.DdrMode = QSPI_DDR_MODE_DISABLE;
+                cmd.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
+                cmd.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
+                cmd.InstructionMode = QSPI_INSTRUCTION_4_LINES;
+                cmd.AddressMode = list[i].address_mode;
+                cmd.DataMode = list[i].data_mode;
+                cmd.DummyCycles = 0;
+                cmd.Instruction =
+                    opcodes_4B ?
+                        list[i].instruction_4B : list[i].instruction;
+                if (i >= cmd_erase_sector && i <= cmd_erase_block64K
+                    && pdevice_->erase_instructions[i - cmd_erase_sector] != 0)
+                  {
+                    cmd.Instruction = pdevice_->erase_instructions[i
+                        - cmd_erase_sector];
+                  }
+              }
+            cmd.Address = 0;
+            cmd.NbData = 0;
+
+            // Same fields as HAL_QSPI_Command() writes, indirect write mode
+            // (a read is switched to indirect read by HAL_QSPI_Receive_DMA)
+            uint32_t ccr = cmd.DdrMode | cmd.DdrHoldHalfCycle | cmd.SIOOMode
+                | cmd.DataMode | (cmd.DummyCycles << QUADSPI_CCR_DCYC_Pos)
+                | cmd.InstructionMode | cmd.Instruction;
+            if (cmd.AlternateByteMode != QSPI_ALTERNATE_BYTES_NONE)
+              {
+                ccr |= cmd.AlternateByteMode | cmd.AlternateBytesSize;
+              }
+            if (cmd.AddressMode != QSPI_ADDRESS_NONE)
+              {
+                ccr |= cmd.AddressMode | cmd.AddressSize;
+              }
+            commands_[i].ccr = ccr;
+          }
+      }
+
+      /**
+       * @brief  Send a pre-computed command, by writing the QUADSPI
+       *    registers directly. Commands without data are waited for; for
+       *    the others, the data phase is started by the HAL DMA calls.
+       *    Falls back to HAL_QSPI_Command() if direct commands are off or
+       *    if the peripheral is not ready.
+       * @param  id: the command.
+       * @param  address: the address, if the command has one.
+       * @param  count: the data size, if the command has a data phase.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::issue_command (command_id_t id, uint32_t address,
+                                size_t count)
+      {
+        command_descr_t& cd = commands_[id];
+        QUADSPI_TypeDef* regs = hqspi_->Instance;
+
+        exit_mem_mapped ();
+
+        if (direct_commands_ == false || hqspi_->State != HAL_QSPI_STATE_READY
+            || wait_status (QUADSPI_SR_BUSY, false) != ok)
+          {
+            cd.hal.Address = address;
+            cd.hal.NbData = count;
+            return qspi_command (hqspi_, &cd.hal, TIMEOUT);
+          }
+
+        if (cd.hal.DataMode != QSPI_DATA_NONE)
+          {
+            WRITE_REG(regs->DLR, count - 1);
+          }
+        if (cd.hal.AlternateByteMode != QSPI_ALTERNATE_BYTES_NONE)
+          {
+            WRITE_REG(regs->ABR, cd.hal.AlternateBytes);
+          }
+
+        // The command starts with the CCR write if it has no address,
+        // otherwise with the AR write (or with the data, if any)
+        WRITE_REG(regs->CCR, cd.ccr);
+        if (cd.hal.AddressMode != QSPI_ADDRESS_NONE)
+          {
+            WRITE_REG(regs->AR, address);
+          }
+
+        if (cd.hal.DataMode == QSPI_DATA_NONE)
+          {
+            if (wait_status (QUADSPI_SR_TCF, true) != ok)
+              {
+                return timeout;
+              }
+            WRITE_REG(regs->FCR, QUADSPI_FCR_CTCF);
+          }
+
+        return ok;
+      }
+
+      /**
+       * @brief  Wait for a flag of the QUADSPI status register.
+       * @param  flag: the flag.
+       * @param  state: the state to wait for.
+       * @return qspi::ok if successful, qspi::timeout otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::wait_status (uint32_t flag, bool state)
+      {
+        uint32_t start = HAL_GetTick ();
+
+        while (((READ_REG(hqspi_->Instance->SR) & flag) != 0) != state)
+          {
+            if ((HAL_GetTick () - start) > TIMEOUT)
+              {
+                return timeout;
+              }
+          }
+
+        return ok;
+      }
+
       qspi_impl::qspi_result_t
       qspi_impl::qspi_command (QSPI_HandleTypeDef* hq, QSPI_CommandTypeDef* cmd,
                                uint32_t timeout)
       {
-        qspi_impl::qspi_result_t result =
-            (qspi_impl::qspi_result_t) HAL_QSPI_Command (hq, cmd, timeout);
+        qspi_impl::qspi_result_t result;
+
+        // Any command leaves the memory mapped mode (it is re-entered lazily,
+        // by the next block read)
+        exit_mem_mapped ();
+
+        result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (hq, cmd, timeout);
 
         if (result != ok)
           {
@@ -846,7 +3197,7 @@ namespace os
       size_t
       qspi_impl::get_sector_size (void)
       {
-        return (pdevice_ == nullptr) ? 0 : pdevice_->sector_size;
+        return (pdevice_ == nullptr) ? 0 : pdevice_->sector_size * chips_;
       }
 
       /**
@@ -860,9 +3211,7 @@ namespace os
 
         if (pdevice_ != nullptr)
           {
-            size_t size = pdevice_->device_ID & 0xFF;
-            size = (1 << size);
-            return size / pdevice_->sector_size;
+            return capacity_ / get_sector_size ();
           }
 
         return size;
@@ -874,7 +3223,17 @@ namespace os
       void
       qspi_impl::cb_event (void)
       {
-        semaphore_.post ();
+        if (erase_polling_)
+          {
+            // end of an erase
+            erase_polling_ = false;
+            erase_done_ = true;
+            erase_sem_.post ();
+          }
+        else
+          {
+            semaphore_.post ();
+          }
       }
 
     } /* namespace stm32f7 */
@@ -0,0 +1,834 @@
+/*
+ * qspi-ftl.cpp
+ *
+ * Copyright (c) 2026 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Created on: 16 Oct 2026 (LNP)
+ */
+
+/*
+ * This file implements a wear-leveling flash translation layer on top of
+ * the QSPI flash driver.
+ *
+ * Each erase sector (4K) is split in 8 slots of 512 bytes: the first one
+ * holds the sector header, the other 7 hold logical blocks. A write goes
+ * to the next free slot of the active sector (page programs only), then
+ * the logical block number is programmed in the header; the previous copy
+ * of the block becomes stale. Free sectors are erased in advance by the
+ * garbage collector, which also moves the live blocks out of the sectors
+ * with the most stale slots. At open, the mapping table is rebuilt from
+ * the headers; of several copies of a block, the one in the most recently
+ * allocated sector (highest sequence number) wins.
+ */
+
+#include <string.h>
+#include <cmsis-plus/rtos/os.h>
+#include <cmsis-plus/diag/trace.h>
+#include "qspi-ftl.h"
+#include "qspi-kernels.h"
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+      /**
+       * @brief Constructor.
+       * @param flash: the QSPI flash driver.
+       * @param reserve: number of sectors kept as spare (not counted in the
+       *    capacity); more spare sectors mean less garbage collection work.
+       */
+      qspi_ftl::qspi_ftl (qspi_impl& flash, std::size_t reserve) :
+          flash_ (flash), reserve_ (reserve)
+      {
+        trace::printf ("%s() @%p\n", __func__, this);
+        if (reserve_ <= GC_FREE_TARGET)
+          {
+            reserve_ = GC_FREE_TARGET + 1;
+          }
+      }
+
+      qspi_ftl::~qspi_ftl ()
+      {
+        trace::printf ("%s() @%p\n", __func__, this);
+        delete[] map_;
+        delete[] seq_;
+        delete[] erases_;
+        delete[] valid_;
+      }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+      //----------------- POSIX interface ------------------------------
+
+      bool
+      qspi_ftl::do_is_opened (void)
+      {
+        return is_opened_;
+      }
+
+      /**
+       * @brief Open the translation layer: initialize the flash and rebuild
+       *    the mapping table.
+       * @param path: not used.
+       * @param oflag: not used.
+       * @param args: not used.
+       * @return 0 if successful, -1 otherwise.
+       */
+      int
+      qspi_ftl::do_vopen (const char* path, int oflag, std::va_list args)
+      {
+        if (is_opened_)
+          {
+            errno = EEXIST; // already opened
+            return -1;
+          }
+
+        if (flash_.initialize () != qspi_impl::ok)
+          {
+            errno = EIO;
+            return -1;
+          }
+
+        // the slot index must fit the 16 bit mapping table
+        sectors_ = flash_.get_sector_count ();
+        if (sectors_ > UNMAPPED / SLOTS)
+          {
+            sectors_ = UNMAPPED / SLOTS;
+          }
+        if (flash_.get_sector_size () != SECTOR_SIZE || sectors_ <= reserve_)
+          {
+            flash_.uninitialize ();
+            errno = EINVAL;
+            return -1;
+          }
+
+        num_blocks_ = (sectors_ - reserve_) * (SLOTS - 1);
+        block_logical_size_bytes_ = BLOCK_SIZE;
+        block_physical_size_bytes_ = BLOCK_SIZE;
+
+        delete[] map_;
+        delete[] seq_;
+        delete[] erases_;
+        delete[] valid_;
+        map_ = new uint16_t[num_blocks_];
+        seq_ = new uint32_t[sectors_];
+        erases_ = new uint32_t[sectors_];
+        valid_ = new uint8_t[sectors_];
+
+        if (mount () != qspi_impl::ok)
+          {
+            flash_.uninitialize ();
+            errno = EIO;
+            return -1;
+          }
+
+        is_opened_ = true;
+        return 0;
+      }
+
+      /**
+       * @brief Read blocks.
+       * @param buf: buffer to receive the data.
+       * @param blknum: first logical block.
+       * @param nblocks: number of blocks to read.
+       * @return Number of blocks read or -1 if error.
+       */
+      ssize_t
+      qspi_ftl::do_read_block (void* buf, blknum_t blknum, std::size_t nblocks)
+      {
+        uint8_t* p = (uint8_t*) buf;
+
+        for (size_t i = 0; i < nblocks; i++, p += BLOCK_SIZE)
+          {
+            uint16_t slot = map_[blknum + i];
+
+            if (slot == UNMAPPED)
+              {
+                // never written
+                memset (p, 0xFF, BLOCK_SIZE);
+              }
+            else if (flash_.read (slot * BLOCK_SIZE, p, BLOCK_SIZE)
+                != qspi_impl::ok)
+              {
+                errno = EIO;
+                return -1;
+              }
+          }
+
+        return nblocks;
+      }
+
+      /**
+       * @brief Write blocks, out-of-place.
+       * @param buf: buffer with the data to be written.
+       * @param blknum: first logical block.
+       * @param nblocks: number of blocks to be written.
+       * @return Number of blocks written or -1 if error.
+       */
+      ssize_t
+      qspi_ftl::do_write_block (const void* buf, blknum_t blknum,
+                                std::size_t nblocks)
+      {
+        const uint8_t* p = (const uint8_t*) buf;
+
+        for (size_t i = 0; i < nblocks; i++, p += BLOCK_SIZE)
+          {
+            if (write_slot (blknum + i, p) != qspi_impl::ok)
+              {
+                errno = EIO;
+                return -1;
+              }
+          }
+
+        return nblocks;
+      }
+
+      /**
+       * @brief Control the device parameters.
+       * @param request: command to the device (ioctl_trim, ioctl_gc or
+       *    ioctl_gc_policy).
+       * @param args: command's parameter(s).
+       * @return 0 if successful, -1 otherwise; for ioctl_gc, 1 if there is
+       *    more work to do.
+       */
+      int
+      qspi_ftl::do_vioctl (int request, std::va_list args)
+      {
+        if (!is_opened_)
+          {
+            errno = EBADF;
+            return -1;
+          }
+
+        switch (request)
+          {
+          case qspi_impl::ioctl_trim:
+            {
+              // ChaN FatFs style, range of blocks {first, last} (inclusive)
+              uint32_t* range = va_arg(args, uint32_t*);
+
+              if (range == nullptr || range[0] > range[1]
+                  || range[1] >= num_blocks_)
+                {
+                  errno = EINVAL;
+                  return -1;
+                }
+              for (uint32_t b = range[0]; b <= range[1]; b++)
+                {
+                  unmap (b);
+                }
+              return 0;
+            }
+
+          case ioctl_gc:
+            return gc_step ();
+
+          case ioctl_gc_policy:
+            policy_ = (gc_policy_t) va_arg(args, int);
+            return 0;
+
+          default:
+            break;
+          }
+
+        return -1;
+      }
+
+      /**
+       * @brief Synch (flush) the data to the device; there is nothing to
+       *    do, writes are not buffered.
+       */
+      void
+      qspi_ftl::do_sync (void)
+      {
+      }
+
+      /**
+       * @brief Close the translation layer.
+       * @return 0 if successful, -1 otherwise.
+       */
+      int
+      qspi_ftl::do_close (void)
+      {
+        if (finish_erase (true) != qspi_impl::ok
+            || flash_.uninitialize () != qspi_impl::ok)
+          {
+            errno = EIO;
+            return -1;
+          }
+
+        is_opened_ = false;
+        return 0;
+      }
+
+      //------------- End of POSIX interface ---------------------------
+
+#pragma GCC diagnostic pop
+
+      /**
+       * @brief  Garbage collector thread function. Run it at a low priority,
+       *    so that the collection is done when the system is idle, e.g.:
+       *
+       *    rtos::thread th { "ftl-gc", qspi_ftl::gc_thread, &ftl, attr };
+       *
+       * @param  args: pointer to the (lockable) block device.
+       * @return never returns.
+       */
+      void*
+      qspi_ftl::gc_thread (void* args)
+      {
+        posix::block_device* bd = (posix::block_device*) args;
+
+        for (;;)
+          {
+            int result = bd->ioctl (ioctl_gc);
+            rtos::sysclock.sleep_for ((result > 0) ? GC_POLL : GC_IDLE);
+          }
+
+        return nullptr;
+      }
+
+      /**
+       * @brief  Rebuild the mapping table and the sector states from the
+       *    sector headers.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_ftl::mount (void)
+      {
+        qspi_impl::qspi_result_t result;
+        header_t h;
+
+        memset (map_, 0xFF, num_blocks_ * sizeof(uint16_t));
+        seq_counter_ = 0;
+        active_ = NO_SECTOR;
+        next_slot_ = SLOTS;
+        erasing_ = NO_SECTOR;
+
+        for (uint32_t s = 0; s < sectors_; s++)
+          {
+            result = flash_.read (s * SECTOR_SIZE, buff_, sizeof(h));
+            if (result != qspi_impl::ok)
+              {
+                return result;
+              }
+            memcpy (&h, buff_, sizeof(h));
+
+            seq_[s] = 0;
+            erases_[s] = 0;
+            valid_[s] = 0;
+
+            if (h.magic == MAGIC)
+              {
+                erases_[s] = h.erases;
+                if (h.seq == 0xFFFFFFFF)
+                  {
+                    // erased, not yet allocated
+                    valid_[s] = ERASED;
+                    continue;
+                  }
+
+                seq_[s] = h.seq;
+                if (h.seq > seq_counter_)
+                  {
+                    seq_counter_ = h.seq;
+                  }
+
+                // keep the newest copy of each block
+                for (size_t i = 0; i < SLOTS - 1; i++)
+                  {
+                    uint16_t slot = s * SLOTS + i + 1;
+                    uint16_t lba = h.lba[i];
+                    if (lba >= num_blocks_)
+                      {
+                        continue;
+                      }
+                    uint16_t old = map_[lba];
+                    if (old == UNMAPPED || seq_[old / SLOTS] < h.seq
+                        || (seq_[old / SLOTS] == h.seq && old < slot))
+                      {
+                        map_[lba] = slot;
+                      }
+                  }
+              }
+            else if (h.magic == 0xFFFFFFFF)
+              {
+                // never used (e.g. new chip), is it entirely erased?
+                bool blank = true;
+                for (size_t off = 0; off < SECTOR_SIZE && blank; off +=
+                    BLOCK_SIZE)
+                  {
+                    result = flash_.read (s * SECTOR_SIZE + off, buff_,
+                                          BLOCK_SIZE);
+                    if (result != qspi_impl::ok)
+                      {
+                        return result;
+                      }
+                    blank = qspi_kernels::all_ones (buff_, BLOCK_SIZE);
+                  }
+                valid_[s] = blank ? ERASED : 0;
+              }
+          }
+
+        // count the live blocks of each sector
+        for (size_t b = 0; b < num_blocks_; b++)
+          {
+            if (map_[b] != UNMAPPED)
+              {
+                valid_[map_[b] / SLOTS]++;
+              }
+          }
+
+        return qspi_impl::ok;
+      }
+
+      /**
+       * @brief  Write a logical block in the next free slot.
+       * @param  blknum: logical block.
+       * @param  data: block data.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_ftl::write_slot (blknum_t blknum, const uint8_t* data)
+      {
+        qspi_impl::qspi_result_t result;
+        uint16_t lba = blknum;
+
+        // a background erase is not waited for, it is suspended for the
+        // programs (see program())
+        result = finish_erase (false);
+        if (result == qspi_impl::busy)
+          {
+            result = qspi_impl::ok;
+          }
+        if (result == qspi_impl::ok && next_slot_ >= SLOTS)
+          {
+            result = allocate ();
+          }
+        if (result != qspi_impl::ok)
+          {
+            return result;
+          }
+
+        uint32_t address = active_ * SECTOR_SIZE;
+
+        // the slot is erased, all 0xFF data needs no programming
+        if (!qspi_kernels::all_ones (data, BLOCK_SIZE))
+          {
+            result = program (address + next_slot_ * BLOCK_SIZE,
+                              (uint8_t*) data, BLOCK_SIZE);
+          }
+        if (result == qspi_impl::ok)
+          {
+            // commit: record the block number in the header
+            result = program (
+                address + offsetof(header_t, lba)
+                    + (next_slot_ - 1) * sizeof(uint16_t),
+                (uint8_t*) &lba, sizeof(uint16_t));
+          }
+        if (result == qspi_impl::ok)
+          {
+            unmap (blknum);
+            map_[blknum] = active_ * SLOTS + next_slot_;
+            valid_[active_]++;
+          }
+
+        // the slot is used even if the write failed
+        next_slot_++;
+        return result;
+      }
+
+      /**
+       * @brief  Program data in the active or in an erased sector. A
+       *    background erase in progress is suspended meanwhile; if the
+       *    device cannot suspend an erase, its end is waited for.
+       * @param  address: flash address.
+       * @param  data: data to be programmed.
+       * @param  count: number of bytes.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_ftl::program (uint32_t address, uint8_t* data, size_t count)
+      {
+        qspi_impl::qspi_result_t result;
+
+        if (erasing_ == NO_SECTOR)
+          {
+            return flash_.write (address, data, count);
+          }
+
+        result = flash_.write_during_erase (address, data, count);
+        if (result == qspi_impl::busy)
+          {
+            result = finish_erase (true);
+            if (result == qspi_impl::ok)
+              {
+                result = flash_.write (address, data, count);
+              }
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Take an erased sector as the new active sector. If needed,
+       *    run the garbage collector, keeping the last erased sector for the
+       *    collector's own use.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_ftl::allocate (void)
+      {
+        qspi_impl::qspi_result_t result;
+        uint32_t s;
+
+        for (;;)
+          {
+            s = free_sector (true);
+            if (s != NO_SECTOR && (relocating_ || erased_count () > 1))
+              {
+                break;
+              }
+            if (relocating_)
+              {
+                // no room left to move the live blocks
+                return qspi_impl::error;
+              }
+            result = collect ();
+            if (result != qspi_impl::ok)
+              {
+                if (s == NO_SECTOR)
+                  {
+                    return result;
+                  }
+                break;
+              }
+          }
+
+        header_t h;
+        h.magic = MAGIC;
+        h.seq = ++seq_counter_;
+        h.erases = erases_[s];
+        result = program (s * SECTOR_SIZE, (uint8_t*) &h,
+                          offsetof(header_t, lba));
+        if (result == qspi_impl::ok)
+          {
+            seq_[s] = h.seq;
+            valid_[s] = 0;
+            active_ = s;
+            next_slot_ = 1;
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  One synchronous garbage collection step: erase a free sector
+       *    or, if there is none, move the live blocks out of a victim sector.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_ftl::collect (void)
+      {
+        qspi_impl::qspi_result_t result;
+        uint32_t s;
+
+        result = finish_erase (true);
+        if (result != qspi_impl::ok)
+          {
+            return result;
+          }
+
+        s = free_sector (false);
+        if (s != NO_SECTOR)
+          {
+            result = flash_.start_erase (s * SECTOR_SIZE,
+                                         qspi_impl::erase_kind_sector);
+            if (result == qspi_impl::ok)
+              {
+                erasing_ = s;
+                result = finish_erase (true);
+              }
+            return result;
+          }
+
+        s = select_victim ();
+        if (s == NO_SECTOR)
+          {
+            return qspi_impl::error;
+          }
+        return relocate (s);
+      }
+
+      /**
+       * @brief  Move the live blocks of a sector to the active sector; the
+       *    sector becomes free (to be erased).
+       * @param  sector: the victim sector.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_ftl::relocate (uint32_t sector)
+      {
+        qspi_impl::qspi_result_t result;
+        header_t h;
+
+        result = flash_.read (sector * SECTOR_SIZE, buff_, sizeof(h));
+        memcpy (&h, buff_, sizeof(h));
+
+        relocating_ = true;
+        for (size_t i = 0; i < SLOTS - 1 && result == qspi_impl::ok; i++)
+          {
+            uint16_t slot = sector * SLOTS + i + 1;
+            if (h.lba[i] < num_blocks_ && map_[h.lba[i]] == slot)
+              {
+                result = flash_.read (slot * BLOCK_SIZE, buff_, BLOCK_SIZE);
+                if (result == qspi_impl::ok)
+                  {
+                    result = write_slot (h.lba[i], buff_);
+                  }
+              }
+          }
+        relocating_ = false;
+
+        if (result == qspi_impl::ok && valid_[sector] == 0)
+          {
+            seq_[sector] = 0;
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Complete the erase of a free sector: write its header with
+       *    the new erase count and mark it as erased.
+       * @param  wait: if true, wait for the erase to end.
+       * @return qspi::ok if no erase is pending any more, qspi::busy if not
+       *    waiting and the erase is still in progress, or a qspi error.
+       */
+      qspi_impl::qspi_result_t
+      qspi_ftl::finish_erase (bool wait)
+      {
+        qspi_impl::qspi_result_t result;
+
+        if (erasing_ == NO_SECTOR)
+          {
+            return qspi_impl::ok;
+          }
+
+        result = wait ? flash_.wait_erase (ERASE_TIMEOUT) : //
+            flash_.erase_status ();
+        if (result == qspi_impl::ok)
+          {
+            uint32_t s = erasing_;
+            header_t h;
+
+            erasing_ = NO_SECTOR;
+            h.magic = MAGIC;
+            h.seq = 0xFFFFFFFF;
+            h.erases = ++erases_[s];
+            result = flash_.write (s * SECTOR_SIZE, (uint8_t*) &h,
+                                   offsetof(header_t, lba));
+            if (result == qspi_impl::ok)
+              {
+                valid_[s] = ERASED;
+              }
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Select the sector to be garbage collected.
+       * @return The victim sector, or NO_SECTOR if none is worth collecting.
+       */
+      uint32_t
+      qspi_ftl::select_victim (void)
+      {
+        uint32_t victim = NO_SECTOR;
+        uint64_t best_num = 0;
+        uint64_t best_den = 1;
+
+        for (uint32_t s = 0; s < sectors_; s++)
+          {
+            uint32_t v = valid_[s];
+
+            // only used sectors with stale slots
+            if (seq_[s] == 0 || s == active_ || v >= SLOTS - 1)
+              {
+                continue;
+              }
+            if (v == 0)
+              {
+                // nothing to move
+                return s;
+              }
+
+            uint64_t num;
+            uint64_t den;
+            if (policy_ == gc_greedy)
+              {
+                // fewest live blocks
+                num = 1;
+                den = v;
+              }
+            else
+              {
+                // cost-benefit: age * (1 - u) / 2u, u = v / (SLOTS - 1)
+                num = (uint64_t) (seq_counter_ - seq_[s] + 1)
+                    * (SLOTS - 1 - v);
+                den = 2 * v;
+              }
+            if (victim == NO_SECTOR || num * best_den > best_num * den)
+              {
+                victim = s;
+                best_num = num;
+                best_den = den;
+              }
+          }
+
+        return victim;
+      }
+
+      /**
+       * @brief  Find the free sector with the lowest erase count.
+       * @param  erased: if true, look for an erased sector, otherwise for one
+       *    to be erased.
+       * @return The sector, or NO_SECTOR if none was found.
+       */
+      uint32_t
+      qspi_ftl::free_sector (bool erased)
+      {
+        uint32_t found = NO_SECTOR;
+
+        for (uint32_t s = 0; s < sectors_; s++)
+          {
+            if (seq_[s] == 0 && s != erasing_
+                && (valid_[s] == ERASED) == erased
+                && (found == NO_SECTOR || erases_[s] < erases_[found]))
+              {
+                found = s;
+              }
+          }
+
+        return found;
+      }
+
+      /**
+       * @brief  Count the erased sectors, ready to be allocated.
+       * @return Number of erased sectors.
+       */
+      size_t
+      qspi_ftl::erased_count (void)
+      {
+        size_t count = 0;
+
+        for (uint32_t s = 0; s < sectors_; s++)
+          {
+            if (seq_[s] == 0 && valid_[s] == ERASED)
+              {
+                count++;
+              }
+          }
+
+        return count;
+      }
+
+      /**
+       * @brief  Drop the mapping of a logical block; its slot becomes stale.
+       * @param  blknum: logical block.
+       */
+      void
+      qspi_ftl::unmap (blknum_t blknum)
+      {
+        uint16_t slot = map_[blknum];
+
+        if (slot != UNMAPPED)
+          {
+            valid_[slot / SLOTS]--;
+            map_[blknum] = UNMAPPED;
+          }
+      }
+
+      /**
+       * @brief  One step of background garbage collection: keep a few
+       *    erased sectors ready, so that writes never wait for an erase. The
+       *    erases are started without waiting for their end.
+       * @return 1 if there is more work to do, 0 if not, -1 if error.
+       */
+      int
+      qspi_ftl::gc_step (void)
+      {
+        qspi_impl::qspi_result_t result;
+        uint32_t s;
+
+        result = finish_erase (false);
+        if (result == qspi_impl::busy)
+          {
+            return 1;
+          }
+
+        if (result == qspi_impl::ok && erased_count () >= GC_FREE_TARGET)
+          {
+            return 0;
+          }
+
+        if (result == qspi_impl::ok)
+          {
+            s = free_sector (false);
+            if (s != NO_SECTOR)
+              {
+                result = flash_.start_erase (s * SECTOR_SIZE,
+                                             qspi_impl::erase_kind_sector);
+                if (result == qspi_impl::ok)
+                  {
+                    erasing_ = s;
+                    return 1;
+                  }
+              }
+            else
+              {
+                s = select_victim ();
+                if (s == NO_SECTOR)
+                  {
+                    return 0;
+                  }
+                result = relocate (s);
+              }
+          }
+
+        if (result != qspi_impl::ok)
+          {
+            errno = EIO;
+            return -1;
+          }
+
+        return 1;
+      }
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
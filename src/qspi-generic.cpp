@@ -0,0 +1,444 @@
+/*
+ * qspi-generic.cpp
+ *
+ * Copyright (c) 2026 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Created on: 16 Oct 2026 (LNP)
+ */
+
+/*
+ * This file implements the discovery of the flash devices through their
+ * JESD216 SFDP (Serial Flash Discoverable Parameters) tables, and the
+ * basic low level functions to control them.
+ */
+
+#include <cmsis-plus/rtos/os.h>
+#include <cmsis-plus/diag/trace.h>
+
+#include "qspi-generic.h"
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+
+      /**
+       * @brief  Describe the device from its SFDP parameters. The 4-4-4
+       *    read mode clocks are sent as alt bytes with all bits set (no
+       *    continuous read mode), or added to the dummy cycles.
+       * @param  params: the SFDP parameters.
+       * @param  device_ID: the memory type and capacity from the JEDEC ID.
+       */
+      qspi_generic::qspi_generic (const sfdp_params_t& params,
+                                  uint16_t device_ID) :
+          qspi_intern (params.suspend, params.resume), //
+          params_ (params), //
+          device_
+            { }
+      {
+        device_.device_ID = device_ID;
+        device_.sector_size = 4096;
+        device_.device_name = "SFDP device";
+        device_.alt_bytes = 0xFFFF;
+        device_.alt_bytes_mode = QSPI_ALTERNATE_BYTES_NONE;
+        device_.alt_bytes_size = QSPI_ALTERNATE_BYTES_8_BITS;
+        device_.dummy_cycles = params.read_444_dummy + params.read_444_mode;
+        if (params.read_444_mode == 2 || params.read_444_mode == 4)
+          {
+            device_.alt_bytes_mode = QSPI_ALTERNATE_BYTES_4_LINES;
+            device_.alt_bytes_size =
+                (params.read_444_mode == 2) ? QSPI_ALTERNATE_BYTES_8_BITS :
+                    QSPI_ALTERNATE_BYTES_16_BITS;
+            device_.alt_bytes_cycles = params.read_444_mode;
+          }
+        device_.read_instruction = params.read_444;
+        device_.erase_instructions[0] = params.erase_4K;
+        device_.erase_instructions[1] = params.erase_32K;
+        device_.erase_instructions[2] = params.erase_64K;
+      }
+
+      /**
+       * @brief  Switch the flash chip to quad mode: set the quad enable bit
+       *    if required, then enter the 4-4-4 mode, as described by the SFDP
+       *    parameters. The read dummy cycles are the default ones.
+       * @return qspi_impl::ok if successful, an error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_generic::enter_quad_mode (qspi_impl* pq)
+      {
+        qspi_impl::qspi_result_t result = qspi_impl::ok;
+
+        // Enable sequences: bit 0 - QE bit then 0x38, bit 1 - 0x38,
+        // bit 2 - 0x35
+        if (params_.qpi_enable & 0x01)
+          {
+            result = set_quad_enable (pq);
+          }
+        if (result == qspi_impl::ok)
+          {
+            result = command (
+                pq, (params_.qpi_enable & 0x03) ? ENTER_QPI : ENTER_QPI_ALT,
+                nullptr, 0, false);
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Check if an erase operation is suspended. There is no
+       *    standard suspend status bit, therefore a suspended erase is
+       *    always assumed (a resume command is ignored by a device that is
+       *    not suspended).
+       * @param  suspended: returns true.
+       * @return qspi_impl::ok.
+       */
+      qspi_impl::qspi_result_t
+      qspi_generic::is_suspended (qspi_impl* pq __attribute__((unused)),
+                                  bool& suspended)
+      {
+        suspended = true;
+        return qspi_impl::ok;
+      }
+
+      /**
+       * @brief  Read the SFDP basic flash parameter table (in SPI mode).
+       * @param  pq: the flash.
+       * @param  params: returns the parameters.
+       * @return qspi_impl::ok if successful, qspi_impl::type_not_found if
+       *    the device has no SFDP tables, an error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_generic::read_parameters (qspi_impl* pq, sfdp_params_t& params)
+      {
+        qspi_impl::qspi_result_t result;
+        uint8_t header[16];
+        uint32_t dw[BFPT_DWORDS] =
+          { };
+
+        params =
+          { };
+
+        // SFDP header and the first parameter header, which is the one of
+        // the basic flash parameter table (ID 0xFF00)
+        result = read_sfdp (pq, 0, header, sizeof(header));
+        if (result != qspi_impl::ok)
+          {
+            return result;
+          }
+        if ((uint32_t) (header[0] | (header[1] << 8) | (header[2] << 16)
+            | (header[3] << 24)) != SFDP_SIGNATURE || header[8] != 0x00
+            || header[15] != 0xFF)
+          {
+            return qspi_impl::type_not_found;
+          }
+
+        size_t dwords = header[11];
+        uint32_t pointer = header[12] | (header[13] << 8) | (header[14] << 16);
+        if (dwords > BFPT_DWORDS)
+          {
+            dwords = BFPT_DWORDS;
+          }
+        if (dwords < 9)
+          {
+            return qspi_impl::type_not_found;
+          }
+
+        result = read_sfdp (pq, pointer, (uint8_t*) dw, dwords * 4);
+        if (result != qspi_impl::ok)
+          {
+            return result;
+          }
+
+        // DWORD 2: density in bits
+        uint64_t bits =
+            (dw[1] & 0x80000000) ?
+                (1ull << (dw[1] & 0x3F)) : (uint64_t) dw[1] + 1;
+        params.capacity =
+            (bits / 8 > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t) (bits / 8);
+
+        // DWORD 1: 4K erase; DWORDS 8 and 9: erase types (size, command)
+        if ((dw[0] & 0x03) == 0x01)
+          {
+            params.erase_4K = (dw[0] >> 8) & 0xFF;
+          }
+        for (int i = 0; i < 4; i++)
+          {
+            uint32_t type = dw[7 + i / 2] >> (16 * (i % 2));
+            switch (type & 0xFF)
+              {
+              case 12:
+                params.erase_4K = (type >> 8) & 0xFF;
+                break;
+              case 15:
+                params.erase_32K = (type >> 8) & 0xFF;
+                break;
+              case 16:
+                params.erase_64K = (type >> 8) & 0xFF;
+                break;
+              default:
+                break;
+              }
+          }
+
+        // 1-4-4 (DWORDS 1 and 3) and 4-4-4 (DWORDS 5 and 7) fast reads
+        if (dw[0] & (1 << 21))
+          {
+            params.read_144 = (dw[2] >> 8) & 0xFF;
+            params.read_144_dummy = dw[2] & 0x1F;
+            params.read_144_mode = (dw[2] >> 5) & 0x07;
+          }
+        if (dw[4] & (1 << 4))
+          {
+            params.read_444 = dw[6] >> 24;
+            params.read_444_dummy = (dw[6] >> 16) & 0x1F;
+            params.read_444_mode = (dw[6] >> 21) & 0x07;
+          }
+
+        // JESD216A and later: page size, suspend/resume, quad enable
+        params.page_size = qspi_impl::PAGE_SIZE;
+        if (dwords >= 11)
+          {
+            params.page_size = 1u << ((dw[10] >> 4) & 0x0F);
+          }
+        if (dwords >= 13 && (dw[11] & 0x80000000) == 0)
+          {
+            params.suspend = dw[12] >> 24;
+            params.resume = (dw[12] >> 16) & 0xFF;
+          }
+        if (dwords >= 15)
+          {
+            params.qer = (dw[14] >> 20) & 0x07;
+            params.qpi_enable = (dw[14] >> 4) & 0x1F;
+          }
+
+        return qspi_impl::ok;
+      }
+
+      /**
+       * @brief  Check if the driver can run a device with these parameters:
+       *    it works in 4-4-4 mode, with 4K, 32K and 64K erases and pages of
+       *    at least 256 bytes.
+       * @param  params: the SFDP parameters.
+       * @return true if usable, false otherwise.
+       */
+      bool
+      qspi_generic::is_usable (const sfdp_params_t& params)
+      {
+        return params.read_444 != 0 && (params.qpi_enable & 0x07) != 0
+            && params.erase_4K != 0 && params.erase_32K != 0
+            && params.erase_64K != 0 && params.page_size >= qspi_impl::PAGE_SIZE
+            && params.capacity >= qspi_impl::BLOCK_64K_SIZE;
+      }
+
+      /**
+       * @brief  Set the quad enable bit, as described by the quad enable
+       *    requirements, if not already set (the bit is non-volatile).
+       * @return qspi_impl::ok if successful, an error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_generic::set_quad_enable (qspi_impl* pq)
+      {
+        qspi_impl::qspi_result_t result = qspi_impl::ok;
+        uint8_t sr[2] =
+          { };
+        uint8_t write_instruction = qspi_impl::WRITE_STATUS_REGISTER;
+        size_t write_count = 2;
+        uint8_t* pbit = &sr[1];
+        uint8_t mask = 0x02;
+
+        switch (params_.qer)
+          {
+          case 0:
+            return qspi_impl::ok;
+
+          case 2:
+            // bit 6 of status register 1
+            result = command (pq, qspi_impl::READ_STATUS_REGISTER, &sr[0], 1,
+                              true);
+            write_count = 1;
+            pbit = &sr[0];
+            mask = 0x40;
+            break;
+
+          case 3:
+            // bit 7 of status register 2, own read/write instructions
+            result = command (pq, READ_STATUS_REGISTER_2_ALT, &sr[1], 1, true);
+            write_instruction = WRITE_STATUS_REGISTER_2_ALT;
+            write_count = 1;
+            mask = 0x80;
+            break;
+
+          case 6:
+            // bit 1 of status register 2, written alone
+            result = command (pq, READ_STATUS_REGISTER_2, &sr[1], 1, true);
+            write_instruction = WRITE_STATUS_REGISTER_2;
+            write_count = 1;
+            break;
+
+          default:
+            // bit 1 of status register 2, written with status register 1
+            result = command (pq, qspi_impl::READ_STATUS_REGISTER, &sr[0], 1,
+                              true);
+            if (result == qspi_impl::ok)
+              {
+                result = command (pq, READ_STATUS_REGISTER_2, &sr[1], 1, true);
+              }
+            break;
+          }
+
+        if (result == qspi_impl::ok && (*pbit & mask) == 0)
+          {
+            *pbit |= mask;
+            result = command (pq, qspi_impl::WRITE_ENABLE, nullptr, 0, false);
+            if (result == qspi_impl::ok)
+              {
+                result = command (pq, write_instruction,
+                                  (write_count == 1) ? pbit : sr, write_count,
+                                  false);
+                if (result == qspi_impl::ok)
+                  {
+                    result = wait_ready (pq);
+                  }
+              }
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Send a command in SPI mode, without address.
+       * @param  pq: the flash.
+       * @param  instruction: the command.
+       * @param  data: data to send or buffer to receive into, or nullptr.
+       * @param  count: data size.
+       * @param  receive: true to receive data, false to send.
+       * @return qspi_impl::ok if successful, an error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_generic::command (qspi_impl* pq, uint8_t instruction, uint8_t* data,
+                             size_t count, bool receive)
+      {
+        QSPI_CommandTypeDef sCommand;
+        qspi_impl::qspi_result_t result;
+
+        sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
+        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
+        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
+        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
+        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
+        sCommand.InstructionMode = QSPI_INSTRUCTION_1_LINE;
+        sCommand.AddressMode = QSPI_ADDRESS_NONE;
+        sCommand.DataMode = (count == 0) ? QSPI_DATA_NONE : QSPI_DATA_1_LINE;
+        sCommand.DummyCycles = 0;
+        sCommand.NbData = count;
+        sCommand.Instruction = instruction;
+
+        result = pq->qspi_command (pq->hqspi_, &sCommand, qspi_impl::TIMEOUT);
+        if (result == qspi_impl::ok && count != 0)
+          {
+            result = (qspi_impl::qspi_result_t) (
+                receive ?
+                    HAL_QSPI_Receive (pq->hqspi_, data, qspi_impl::TIMEOUT) :
+                    HAL_QSPI_Transmit (pq->hqspi_, data, qspi_impl::TIMEOUT));
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Read from the SFDP area (in SPI mode, 8 dummy cycles).
+       * @param  pq: the flash.
+       * @param  address: address in the SFDP area.
+       * @param  buff: buffer where to copy data to.
+       * @param  count: amount of data.
+       * @return qspi_impl::ok if successful, an error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_generic::read_sfdp (qspi_impl* pq, uint32_t address, uint8_t* buff,
+                               size_t count)
+      {
+        QSPI_CommandTypeDef sCommand;
+        qspi_impl::qspi_result_t result;
+
+        sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
+        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
+        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
+        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
+        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
+        sCommand.InstructionMode = QSPI_INSTRUCTION_1_LINE;
+        sCommand.AddressMode = QSPI_ADDRESS_1_LINE;
+        sCommand.DataMode = QSPI_DATA_1_LINE;
+        sCommand.DummyCycles = 8;
+        sCommand.Address = address;
+        sCommand.NbData = count;
+        sCommand.Instruction = READ_SFDP;
+
+        result = pq->qspi_command (pq->hqspi_, &sCommand, qspi_impl::TIMEOUT);
+        if (result == qspi_impl::ok)
+          {
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_Receive (
+                pq->hqspi_, buff, qspi_impl::TIMEOUT);
+          }
+
+        return result;
+      }
+
+      /**
+       * @brief  Wait for the end of a status register write (in SPI mode).
+       * @param  pq: the flash.
+       * @return qspi_impl::ok if successful, an error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_generic::wait_ready (qspi_impl* pq)
+      {
+        QSPI_CommandTypeDef sCommand;
+        QSPI_AutoPollingTypeDef sConfig;
+
+        sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
+        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
+        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
+        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
+        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
+        sCommand.InstructionMode = QSPI_INSTRUCTION_1_LINE;
+        sCommand.AddressMode = QSPI_ADDRESS_NONE;
+        sCommand.DataMode = QSPI_DATA_1_LINE;
+        sCommand.DummyCycles = 0;
+        sCommand.Instruction = qspi_impl::READ_STATUS_REGISTER;
+
+        sConfig.Match = 0;
+        sConfig.Mask = 1;
+        sConfig.MatchMode = QSPI_MATCH_MODE_AND;
+        sConfig.StatusBytesSize = 1;
+        sConfig.Interval = 0x10;
+        sConfig.AutomaticStop = QSPI_AUTOMATIC_STOP_ENABLE;
+
+        return (qspi_impl::qspi_result_t) HAL_QSPI_AutoPolling (
+            pq->hqspi_, &sCommand, &sConfig, qspi_impl::WRITE_TIMEOUT);
+      }
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
@@ -0,0 +1,131 @@
+/*
+ * qspi-generic.h
+ *
+ * Copyright (c) 2026 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Created on: 16 Oct 2026 (LNP)
+ */
+
+#ifndef QSPI_GENERIC_H_
+#define QSPI_GENERIC_H_
+
+#include "qspi-flash.h"
+#include "qspi-descr.h"
+
+#if defined (__cplusplus)
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+
+      // Parameters read from the JESD216 SFDP basic flash parameter table
+      typedef struct sfdp_params_s
+      {
+        uint32_t capacity;        // bytes
+        uint32_t page_size;       // bytes
+        uint8_t erase_4K;         // erase instructions, 0 if not supported
+        uint8_t erase_32K;
+        uint8_t erase_64K;
+        uint8_t read_144;         // 1-4-4 fast read instruction, or 0
+        uint8_t read_144_dummy;
+        uint8_t read_144_mode;    // mode clocks
+        uint8_t read_444;         // 4-4-4 fast read instruction, or 0
+        uint8_t read_444_dummy;
+        uint8_t read_444_mode;
+        uint8_t qer;              // quad enable requirements
+        uint8_t qpi_enable;       // 4-4-4 mode enable sequences
+        uint8_t suspend;          // erase suspend instruction, or 0
+        uint8_t resume;           // erase resume instruction
+      } sfdp_params_t;
+
+      /*
+       * Devices that are not listed in the tables of qspi-descr.cpp,
+       * described by their SFDP parameters.
+       */
+      class qspi_generic : public qspi_intern
+      {
+
+      public:
+        qspi_generic (const sfdp_params_t& params, uint16_t device_ID);
+
+        virtual qspi_impl::qspi_result_t
+        enter_quad_mode (qspi_impl* pq) override;
+
+        virtual qspi_impl::qspi_result_t
+        is_suspended (qspi_impl* pq, bool& suspended) override;
+
+        const qspi_device_t*
+        device (void);
+
+        static qspi_impl::qspi_result_t
+        read_parameters (qspi_impl* pq, sfdp_params_t& params);
+
+        static bool
+        is_usable (const sfdp_params_t& params);
+
+      private:
+        static qspi_impl::qspi_result_t
+        command (qspi_impl* pq, uint8_t instruction, uint8_t* data,
+                 size_t count, bool receive);
+
+        static qspi_impl::qspi_result_t
+        read_sfdp (qspi_impl* pq, uint32_t address, uint8_t* buff,
+                   size_t count);
+
+        static qspi_impl::qspi_result_t
+        wait_ready (qspi_impl* pq);
+
+        qspi_impl::qspi_result_t
+        set_quad_enable (qspi_impl* pq);
+
+        static constexpr uint8_t READ_SFDP = 0x5A;
+        static constexpr uint32_t SFDP_SIGNATURE = 0x50444653;  // "SFDP"
+        static constexpr size_t BFPT_DWORDS = 16;
+        static constexpr uint8_t READ_STATUS_REGISTER_2 = 0x35;
+        static constexpr uint8_t WRITE_STATUS_REGISTER_2 = 0x31;
+        static constexpr uint8_t READ_STATUS_REGISTER_2_ALT = 0x3F;
+        static constexpr uint8_t WRITE_STATUS_REGISTER_2_ALT = 0x3E;
+        static constexpr uint8_t ENTER_QPI = 0x38;
+        static constexpr uint8_t ENTER_QPI_ALT = 0x35;
+
+        sfdp_params_t params_;
+        qspi_device_t device_;
+      };
+
+      inline const qspi_device_t*
+      qspi_generic::device (void)
+      {
+        return &device_;
+      }
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
+
+#endif
+
+#endif /* QSPI_GENERIC_H_ */
@@ -0,0 +1,209 @@
+/*
+ * qspi-kernels.h
+ *
+ * Copyright (c) 2026 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Created on: 16 Oct 2026 (LNP)
+ */
+
+/*
+ * Buffer scan kernels used by the write path. They work on 32-bit words
+ * (four at a time in the main loop), with byte loops only for the unaligned
+ * head and the tail. The head aligns the flash side pointer, which may
+ * point into the memory mapped window: there, unaligned accesses fault if
+ * the window is not mapped as Normal memory. The RAM buffers may be
+ * loaded unaligned.
+ *
+ * The kernels do not depend on the HAL, so that they can also be built
+ * and benchmarked on a host (see test/bench-qspi-kernels.cpp).
+ */
+
+#ifndef QSPI_KERNELS_H_
+#define QSPI_KERNELS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+      namespace qspi_kernels
+      {
+
+        // Unaligned word load (a single LDR on Cortex-M7, which supports
+        // unaligned accesses to Normal memory)
+        inline uint32_t
+        load32 (const uint8_t* p)
+        {
+          uint32_t w;
+          memcpy (&w, p, sizeof(w));
+          return w;
+        }
+
+        /**
+         * @brief  Check if a buffer is all 0xFF (i.e. erased state).
+         * @param  p: buffer.
+         * @param  count: buffer length.
+         * @return true if all bytes are 0xFF, false otherwise.
+         */
+        inline bool
+        all_ones (const uint8_t* p, size_t count)
+        {
+          for (; count > 0 && ((uintptr_t) p & 3); count--, p++)
+            {
+              if (*p != 0xFF)
+                {
+                  return false;
+                }
+            }
+          for (; count >= 16; count -= 16, p += 16)
+            {
+              if ((load32 (p) & load32 (p + 4) & load32 (p + 8)
+                  & load32 (p + 12)) != 0xFFFFFFFF)
+                {
+                  return false;
+                }
+            }
+          for (; count >= 4; count -= 4, p += 4)
+            {
+              if (load32 (p) != 0xFFFFFFFF)
+                {
+                  return false;
+                }
+            }
+          for (; count > 0; count--, p++)
+            {
+              if (*p != 0xFF)
+                {
+                  return false;
+                }
+            }
+          return true;
+        }
+
+        /**
+         * @brief  Check if new data needs an erase, i.e. if it has bits set
+         *    where the flash has them cleared: (old & new) != new.
+         * @param  old: current content of the flash (e.g. in the memory
+         *    mapped window).
+         * @param  buff: new data.
+         * @param  count: buffer length.
+         * @return true if an erase is needed, false otherwise.
+         */
+        inline bool
+        needs_erase (const uint8_t* old, const uint8_t* buff, size_t count)
+        {
+          for (; count > 0 && ((uintptr_t) old & 3);
+              count--, old++, buff++)
+            {
+              if ((uint8_t) (~*old & *buff))
+                {
+                  return true;
+                }
+            }
+          for (; count >= 16; count -= 16, old += 16, buff += 16)
+            {
+              if ((~load32 (old) & load32 (buff))
+                  | (~load32 (old + 4) & load32 (buff + 4))
+                  | (~load32 (old + 8) & load32 (buff + 8))
+                  | (~load32 (old + 12) & load32 (buff + 12)))
+                {
+                  return true;
+                }
+            }
+          for (; count >= 4; count -= 4, old += 4, buff += 4)
+            {
+              if (~load32 (old) & load32 (buff))
+                {
+                  return true;
+                }
+            }
+          for (; count > 0; count--, old++, buff++)
+            {
+              if ((uint8_t) (~*old & *buff))
+                {
+                  return true;
+                }
+            }
+          return false;
+        }
+
+        /**
+         * @brief  Check if new data has bits to program, i.e. bits cleared
+         *    where the flash has them set: (old & ~new) != 0.
+         * @param  old: current content of the flash (e.g. in the memory
+         *    mapped window).
+         * @param  buff: new data.
+         * @param  count: buffer length.
+         * @return true if a program operation is needed, false otherwise.
+         */
+        inline bool
+        has_programmable_bits (const uint8_t* old, const uint8_t* buff,
+                               size_t count)
+        {
+          for (; count > 0 && ((uintptr_t) old & 3);
+              count--, old++, buff++)
+            {
+              if ((uint8_t) (*old & ~*buff))
+                {
+                  return true;
+                }
+            }
+          for (; count >= 16; count -= 16, old += 16, buff += 16)
+            {
+              if ((load32 (old) & ~load32 (buff))
+                  | (load32 (old + 4) & ~load32 (buff + 4))
+                  | (load32 (old + 8) & ~load32 (buff + 8))
+                  | (load32 (old + 12) & ~load32 (buff + 12)))
+                {
+                  return true;
+                }
+            }
+          for (; count >= 4; count -= 4, old += 4, buff += 4)
+            {
+              if (load32 (old) & ~load32 (buff))
+                {
+                  return true;
+                }
+            }
+          for (; count > 0; count--, old++, buff++)
+            {
+              if ((uint8_t) (*old & ~*buff))
+                {
+                  return true;
+                }
+            }
+          return false;
+        }
+
+      } /* namespace qspi_kernels */
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
+
+#endif /* QSPI_KERNELS_H_ */
@@ -66,7 +66,7 @@ namespace os
         sCommand.AddressMode = QSPI_ADDRESS_NONE;
         sCommand.DataMode = QSPI_DATA_NONE;
         sCommand.DummyCycles = 0;
-        sCommand.NbData = 1;
+        sCommand.NbData = pq->chips_; // a data byte for each chip
 
         // Enable volatile write
         sCommand.Instruction = qspi_impl::WRITE_ENABLE;
@@ -80,11 +80,12 @@ namespace os
                                        qspi_impl::TIMEOUT);
             if (result == qspi_impl::ok)
               {
-                // Compute dummy cycles
-                datareg = (pq->pdevice_->dummy_cycles << 4);
-                datareg |= 0xB;
-                result = (qspi_impl::qspi_result_t) HAL_QSPI_Transmit (
-                    pq->hqspi_, &datareg, qspi_impl::TIMEOUT);
+                // Compute dummy cycles; XIP is enabled (bit 3 cleared) if
+                // supported, it is entered only by the reads that send a
+                // cleared confirmation bit
+                datareg = (pq->read_dummy_cycles () << 4);
+                datareg |= pq->pdevice_->continuous_support ? 0x3 : 0xB;
+                result = pq->transmit_register (datareg);
                 if (result == qspi_impl::ok)
                   {
                     // Enable write
@@ -103,9 +104,7 @@ namespace os
                         if (result == qspi_impl::ok)
                           {
                             datareg = 0x6F;	// Enable quad protocol
-                            result =
-                                (qspi_impl::qspi_result_t) HAL_QSPI_Transmit (
-                                    pq->hqspi_, &datareg, qspi_impl::TIMEOUT);
+                            result = pq->transmit_register (datareg);
                             if (result == qspi_impl::ok)
                               {
                                 sCommand.DataMode = QSPI_DATA_NONE;
@@ -122,6 +121,22 @@ namespace os
         return result;
       }
 
+      /**
+       * @brief  Check if an erase or program operation is suspended.
+       * @param  suspended: returns true if an operation is suspended.
+       * @return qspi_impl::ok if successful, an error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_micron::is_suspended (qspi_impl* pq, bool& suspended)
+      {
+        uint8_t datareg = 0;
+        qspi_impl::qspi_result_t result = pq->read_register (
+            READ_FLAG_STATUS_REGISTER, datareg);
+
+        suspended = (datareg & (FSR_ERASE_SUSPEND | FSR_PROGRAM_SUSPEND)) != 0;
+        return result;
+      }
+
     } /* namespace stm32f7 */
   } /* namespace driver */
 } /* namespace os */
@@ -45,9 +45,17 @@ namespace os
       {
 
       public:
+        qspi_micron (void) :
+            qspi_intern (ERASE_PROGRAM_SUSPEND, ERASE_PROGRAM_RESUME)
+        {
+        }
+
         virtual qspi_impl::qspi_result_t
         enter_quad_mode (qspi_impl* pq) override;
 
+        virtual qspi_impl::qspi_result_t
+        is_suspended (qspi_impl* pq, bool& suspended) override;
+
       private:
         // Micron/ST specific commands
         static constexpr uint8_t READ_VOLATILE_STATUS_REGISTER = 0x85;
@@ -55,6 +63,13 @@ namespace os
         static constexpr uint8_t WRITE_VOLATILE_STATUS_REGISTER = 0x81;
         static constexpr uint8_t WRITE_ENH_VOLATILE_STATUS_REGISTER = 0x61;
         static constexpr uint8_t ENTER_QUAD_MODE = 0x38;
+        static constexpr uint8_t READ_FLAG_STATUS_REGISTER = 0x70;
+        // MT25Q uses 0x75/0x7A; older N25Q parts also accept 0xB0/0x30
+        static constexpr uint8_t ERASE_PROGRAM_SUSPEND = 0x75;
+        static constexpr uint8_t ERASE_PROGRAM_RESUME = 0x7A;
+
+        static constexpr uint8_t FSR_ERASE_SUSPEND = 0x40;
+        static constexpr uint8_t FSR_PROGRAM_SUSPEND = 0x04;
 
       };
 
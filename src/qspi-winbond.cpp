@@ -66,7 +66,7 @@ namespace os
         sCommand.AddressMode = QSPI_ADDRESS_NONE;
         sCommand.DataMode = QSPI_DATA_NONE;
         sCommand.DummyCycles = 0;
-        sCommand.NbData = 1;
+        sCommand.NbData = pq->chips_; // a data byte for each chip
 
         // Enable volatile write
         sCommand.Instruction = VOLATILE_SR_WRITE_ENABLE;
@@ -81,8 +81,7 @@ namespace os
             if (result == qspi_impl::ok)
               {
                 datareg = 2;
-                result = (qspi_impl::qspi_result_t) HAL_QSPI_Transmit (
-                    pq->hqspi_, &datareg, qspi_impl::TIMEOUT);
+                result = pq->transmit_register (datareg);
                 if (result == qspi_impl::ok)
                   {
                     sCommand.DataMode = QSPI_DATA_NONE;
@@ -99,11 +98,9 @@ namespace os
                         if (result == qspi_impl::ok)
                           {
                             // Compute and set number of dummy cycles
-                            datareg = (pq->pdevice_->dummy_cycles / 2) - 1;
+                            datareg = (pq->read_dummy_cycles () / 2) - 1;
                             datareg <<= 4;
-                            result =
-                                (qspi_impl::qspi_result_t) HAL_QSPI_Transmit (
-                                    pq->hqspi_, &datareg, qspi_impl::TIMEOUT);
+                            result = pq->transmit_register (datareg);
                           }
                       }
                   }
@@ -112,6 +109,22 @@ namespace os
         return result;
       }
 
+      /**
+       * @brief  Check if an erase or program operation is suspended.
+       * @param  suspended: returns true if an operation is suspended.
+       * @return qspi_impl::ok if successful, an error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_winbond::is_suspended (qspi_impl* pq, bool& suspended)
+      {
+        uint8_t datareg = 0;
+        qspi_impl::qspi_result_t result = pq->read_register (
+            READ_STATUS_REGISTER_2, datareg);
+
+        suspended = (datareg & SR2_SUS) != 0;
+        return result;
+      }
+
     } /* namespace stm32f7 */
   } /* namespace driver */
 } /* namespace os */
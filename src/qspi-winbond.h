@@ -45,9 +45,17 @@ namespace os
       {
 
       public:
+        qspi_winbond (void) :
+            qspi_intern (ERASE_PROGRAM_SUSPEND, ERASE_PROGRAM_RESUME)
+        {
+        }
+
         virtual qspi_impl::qspi_result_t
         enter_quad_mode (qspi_impl* pq) override;
 
+        virtual qspi_impl::qspi_result_t
+        is_suspended (qspi_impl* pq, bool& suspended) override;
+
       private:
         // Winbond specific commands
         static constexpr uint8_t VOLATILE_SR_WRITE_ENABLE = 0x50;
@@ -57,6 +65,10 @@ namespace os
         static constexpr uint8_t WRITE_STATUS_REGISTER_3 = 0x11;
         static constexpr uint8_t ENTER_QUAD_MODE = 0x38;
         static constexpr uint8_t SET_READ_PARAMETERS = 0xC0;
+        static constexpr uint8_t ERASE_PROGRAM_SUSPEND = 0x75;
+        static constexpr uint8_t ERASE_PROGRAM_RESUME = 0x7A;
+
+        static constexpr uint8_t SR2_SUS = 0x80;  // suspend status bit
 
       };
 
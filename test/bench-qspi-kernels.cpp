@@ -0,0 +1,209 @@
+/*
+ * bench-qspi-kernels.cpp
+ *
+ * Copyright (c) 2026 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Created on: 16 Oct 2026 (LNP)
+ */
+
+/*
+ * Host benchmark of the write path scan kernels against the byte loops
+ * they replace. Unlike the other tests, it runs on the development host:
+ *
+ *      g++ -O2 -I../src bench-qspi-kernels.cpp -o bench && ./bench
+ *
+ * Each kernel is first checked against its byte loop on random data (with
+ * independent alignments of the flash and of the RAM side buffers), then
+ * both are timed over a sector sized buffer, at an aligned and at an
+ * unaligned (+3) offset.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+#include "qspi-kernels.h"
+
+using namespace os::driver::stm32f7;
+
+static constexpr size_t sector_size = 4096;
+static constexpr int loops = 20000;
+
+// ---- reference byte by byte loops ----
+
+static bool
+ref_all_ones (const uint8_t* p, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+    {
+      if (*p++ != 0xFF)
+        {
+          return false;
+        }
+    }
+  return true;
+}
+
+static bool
+ref_needs_erase (const uint8_t* old, const uint8_t* buff, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+    {
+      if ((old[i] & buff[i]) != buff[i])
+        {
+          return true;
+        }
+    }
+  return false;
+}
+
+static bool
+ref_has_programmable_bits (const uint8_t* old, const uint8_t* buff,
+                           size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+    {
+      if (old[i] & ~buff[i])
+        {
+          return true;
+        }
+    }
+  return false;
+}
+
+// ---- helpers ----
+
+typedef bool
+(*scan1_t) (const uint8_t*, size_t);
+typedef bool
+(*scan2_t) (const uint8_t*, const uint8_t*, size_t);
+
+static volatile bool sink;
+
+static double
+time_scan (scan1_t f, const uint8_t* p, size_t count)
+{
+  auto start = std::chrono::steady_clock::now ();
+  for (int i = 0; i < loops; i++)
+    {
+      sink = f (p, count);
+    }
+  std::chrono::duration<double, std::micro> d =
+      std::chrono::steady_clock::now () - start;
+  return d.count () / loops;
+}
+
+static double
+time_scan (scan2_t f, const uint8_t* old, const uint8_t* buff, size_t count)
+{
+  auto start = std::chrono::steady_clock::now ();
+  for (int i = 0; i < loops; i++)
+    {
+      sink = f (old, buff, count);
+    }
+  std::chrono::duration<double, std::micro> d =
+      std::chrono::steady_clock::now () - start;
+  return d.count () / loops;
+}
+
+static int
+check (void)
+{
+  uint8_t old[64 + 8];
+  uint8_t buff[64 + 8];
+  int errors = 0;
+
+  srand (0xBABA);
+  for (int n = 0; n < 200000; n++)
+    {
+      size_t off = rand () % 8;
+      size_t boff = rand () % 8;
+      size_t len = rand () % 64;
+
+      // mostly 0xFF, with a few random bytes, so that all cases are hit
+      for (size_t i = 0; i < sizeof(old); i++)
+        {
+          old[i] = (rand () % 8) ? 0xFF : (uint8_t) rand ();
+          buff[i] = (rand () % 4) ? old[i] : (uint8_t) (old[i] & rand ());
+          if ((rand () % 16) == 0)
+            {
+              buff[i] = (uint8_t) rand ();
+            }
+        }
+
+      if (qspi_kernels::all_ones (old + off, len)
+          != ref_all_ones (old + off, len)
+          || qspi_kernels::needs_erase (old + off, buff + boff, len)
+              != ref_needs_erase (old + off, buff + boff, len)
+          || qspi_kernels::has_programmable_bits (old + off, buff + boff,
+                                                  len)
+              != ref_has_programmable_bits (old + off, buff + boff, len))
+        {
+          errors++;
+        }
+    }
+
+  return errors;
+}
+
+int
+main (void)
+{
+  static uint8_t old[sector_size + 8];
+  static uint8_t buff[sector_size + 8];
+  int errors = check ();
+
+  printf ("Kernel check: %s (%d errors)\n", errors ? "FAILED" : "passed",
+          errors);
+
+  // worst case: the scans have to go through the whole buffer
+  memset (old, 0xFF, sizeof(old));
+  memset (buff, 0xFF, sizeof(buff));
+  for (size_t i = 0; i < sector_size; i += 2)
+    {
+      buff[i + 3] = 0x5A;
+    }
+
+  for (size_t off = 0; off <= 3; off += 3)
+    {
+      const uint8_t* b = buff + off;
+
+      printf ("\n%zu bytes, offset %zu (us per call)  loop    kernel\n",
+              sector_size, off);
+      printf ("all ones                        %7.3f %7.3f\n",
+              time_scan (ref_all_ones, old + off, sector_size),
+              time_scan (qspi_kernels::all_ones, old + off, sector_size));
+      printf ("needs erase                     %7.3f %7.3f\n",
+              time_scan (ref_needs_erase, old, b, sector_size),
+              time_scan (qspi_kernels::needs_erase, old, b, sector_size));
+      // has_programmable_bits() stops early on this data, use the old copy
+      printf ("has programmable bits           %7.3f %7.3f\n",
+              time_scan (ref_has_programmable_bits, old, old + off,
+                         sector_size),
+              time_scan (qspi_kernels::has_programmable_bits, old, old + off,
+                         sector_size));
+    }
+
+  return errors ? 1 : 0;
+}
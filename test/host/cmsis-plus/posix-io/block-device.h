@@ -0,0 +1,94 @@
+/*
+ * block-device.h
+ *
+ * Copyright (c) 2026 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Created on: 16 Oct 2026 (LNP)
+ */
+
+/*
+ * Host stand-in for the µOS++ block device classes, reduced to what the
+ * FTL implements, for the host simulation (see sim-qspi-ftl.cpp).
+ */
+
+#ifndef HOST_CMSIS_PLUS_POSIX_IO_BLOCK_DEVICE_H_
+#define HOST_CMSIS_PLUS_POSIX_IO_BLOCK_DEVICE_H_
+
+#include <cmsis-plus/rtos/os.h>
+
+namespace os
+{
+  namespace posix
+  {
+    class block_device
+    {
+    public:
+      typedef std::size_t blknum_t;
+
+      int
+      ioctl (int, ...)
+      {
+        return 0;
+      }
+    };
+
+    class block_device_impl
+    {
+    public:
+      typedef block_device::blknum_t blknum_t;
+
+      virtual
+      ~block_device_impl () = default;
+
+      virtual bool
+      do_is_opened (void) = 0;
+
+      virtual int
+      do_vopen (const char* path, int oflag, std::va_list args) = 0;
+
+      virtual ssize_t
+      do_read_block (void* buf, blknum_t blknum, std::size_t nblocks) = 0;
+
+      virtual ssize_t
+      do_write_block (const void* buf, blknum_t blknum,
+                      std::size_t nblocks) = 0;
+
+      virtual int
+      do_vioctl (int request, std::va_list args) = 0;
+
+      virtual void
+      do_sync (void) = 0;
+
+      virtual int
+      do_close (void) = 0;
+
+    protected:
+      blknum_t num_blocks_ = 0;
+      std::size_t block_logical_size_bytes_ = 0;
+      std::size_t block_physical_size_bytes_ = 0;
+    };
+  }
+}
+
+#endif /* HOST_CMSIS_PLUS_POSIX_IO_BLOCK_DEVICE_H_ */
@@ -0,0 +1,68 @@
+/*
+ * os.h
+ *
+ * Copyright (c) 2026 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Created on: 16 Oct 2026 (LNP)
+ */
+
+/*
+ * Host stand-in for the few µOS++ RTOS definitions used by the FTL, for
+ * the host simulation (see sim-qspi-ftl.cpp).
+ */
+
+#ifndef HOST_CMSIS_PLUS_RTOS_OS_H_
+#define HOST_CMSIS_PLUS_RTOS_OS_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdarg>
+#include <cerrno>
+#include <sys/types.h>
+
+namespace os
+{
+  namespace rtos
+  {
+    namespace clock
+    {
+      typedef uint32_t duration_t;
+    }
+
+    struct sysclock_t
+    {
+      static constexpr uint32_t frequency_hz = 1000;
+
+      int
+      sleep_for (clock::duration_t)
+      {
+        return 0;
+      }
+    };
+
+    extern sysclock_t sysclock;
+  }
+}
+
+#endif /* HOST_CMSIS_PLUS_RTOS_OS_H_ */
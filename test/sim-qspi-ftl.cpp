@@ -0,0 +1,414 @@
+/*
+ * sim-qspi-ftl.cpp
+ *
+ * Copyright (c) 2026 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Created on: 16 Oct 2026 (LNP)
+ */
+
+/*
+ * Host simulation of the flash translation layer over a simulated NOR
+ * flash. Like the kernels benchmark, it runs on the development host:
+ *
+ *      g++ -O2 -Ihost -I../include -I../src sim-qspi-ftl.cpp -o sim && ./sim
+ *
+ * The simulated flash stands in for qspi_impl: programs only clear bits,
+ * erases run in the background for a few status checks, and programs
+ * during an erase are accepted only through write_during_erase(), i.e.
+ * with the erase suspended (optionally, the device cannot suspend). Any
+ * access to the sector being erased is counted as a violation.
+ *
+ * Random writes, with a hot set of blocks, are interleaved with garbage
+ * collection steps, so that erases are often in progress during writes.
+ * Regularly, the power is cut (between flash operations, an erase in
+ * progress is either lost or completed) and the FTL is mounted again;
+ * all blocks are then checked against a model of their content.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <cmsis-plus/rtos/os.h>
+#include <cmsis-plus/diag/trace.h>
+#include <cmsis-plus/posix-io/block-device.h>
+
+// The simulated flash replaces the driver
+#define QSPI_FLASH_H_
+
+namespace os
+{
+  namespace rtos
+  {
+    sysclock_t sysclock;
+  }
+
+  namespace driver
+  {
+    namespace stm32f7
+    {
+      class qspi_impl
+      {
+      public:
+        typedef enum
+        {
+          ok = 0, error, busy, timeout,
+        } qspi_result_t;
+
+        typedef enum
+        {
+          erase_kind_sector = 0x20,
+        } erase_kind_t;
+
+        typedef enum
+        {
+          ioctl_trim = 4,
+        } ioctl_request_t;
+
+        static constexpr size_t SECTOR = 4096;
+        static constexpr size_t SECTORS = 64;
+        static constexpr int ERASE_CHECKS = 3;
+
+        qspi_impl (bool can_suspend) :
+            can_suspend_ (can_suspend)
+        {
+          // a new chip, neither erased nor formatted
+          memset (mem_, 0xA5, sizeof(mem_));
+        }
+
+        qspi_result_t
+        initialize (void)
+        {
+          return ok;
+        }
+
+        qspi_result_t
+        uninitialize (void)
+        {
+          return ok;
+        }
+
+        size_t
+        get_sector_size (void)
+        {
+          return SECTOR;
+        }
+
+        size_t
+        get_sector_count (void)
+        {
+          return SECTORS;
+        }
+
+        qspi_result_t
+        read (uint32_t address, uint8_t* buff, size_t count)
+        {
+          check (address, count);
+          memcpy (buff, mem_ + address, count);
+          return ok;
+        }
+
+        qspi_result_t
+        write (uint32_t address, uint8_t* buff, size_t count)
+        {
+          if (erasing_ >= 0)
+            {
+              return busy;
+            }
+          program (address, buff, count);
+          return ok;
+        }
+
+        qspi_result_t
+        write_during_erase (uint32_t address, uint8_t* buff, size_t count)
+        {
+          if (erasing_ >= 0)
+            {
+              if (!can_suspend_)
+                {
+                  return busy;
+                }
+              suspends++;
+            }
+          program (address, buff, count);
+          return ok;
+        }
+
+        qspi_result_t
+        start_erase (uint32_t address, erase_kind_t kind)
+        {
+          if (erasing_ >= 0 || kind != erase_kind_sector)
+            {
+              return busy;
+            }
+          erasing_ = address / SECTOR;
+          checks_ = ERASE_CHECKS;
+          return ok;
+        }
+
+        qspi_result_t
+        erase_status (void)
+        {
+          if (erasing_ >= 0 && --checks_ == 0)
+            {
+              end_erase ();
+            }
+          return (erasing_ >= 0) ? busy : ok;
+        }
+
+        qspi_result_t
+        wait_erase (uint32_t)
+        {
+          if (erasing_ >= 0)
+            {
+              waits++;
+              end_erase ();
+            }
+          return ok;
+        }
+
+        void
+        power_cut (void)
+        {
+          if (erasing_ >= 0)
+            {
+              if (rand () & 1)
+                {
+                  end_erase ();
+                }
+              erasing_ = -1;
+            }
+        }
+
+        unsigned erases[SECTORS] =
+          { };
+        unsigned suspends = 0;
+        unsigned waits = 0;
+        unsigned violations = 0;
+
+      private:
+        void
+        check (uint32_t address, size_t count)
+        {
+          if (address + count > sizeof(mem_)
+              || (erasing_ >= 0 && address / SECTOR <= (uint32_t) erasing_
+                  && (address + count - 1) / SECTOR >= (uint32_t) erasing_))
+            {
+              violations++;
+            }
+        }
+
+        void
+        program (uint32_t address, uint8_t* buff, size_t count)
+        {
+          check (address, count);
+          for (size_t i = 0; i < count; i++)
+            {
+              mem_[address + i] &= buff[i];
+            }
+        }
+
+        void
+        end_erase (void)
+        {
+          memset (mem_ + erasing_ * SECTOR, 0xFF, SECTOR);
+          erases[erasing_]++;
+          erasing_ = -1;
+        }
+
+        bool can_suspend_;
+        int erasing_ = -1;
+        int checks_ = 0;
+        uint8_t mem_[SECTOR * SECTORS];
+      };
+    }
+  }
+}
+
+#include "../src/qspi-ftl.cpp"
+
+using namespace os::driver::stm32f7;
+
+static constexpr size_t BLOCK = 512;
+static constexpr int WRITES = 100000;
+static constexpr int REMOUNT = 5000;
+
+static int
+open_ftl (qspi_ftl& ftl, ...)
+{
+  std::va_list args;
+
+  va_start(args, ftl);
+  int result = ftl.do_vopen ("", 0, args);
+  va_end(args);
+  return result;
+}
+
+static int
+ioctl_ftl (qspi_ftl& ftl, int request, ...)
+{
+  std::va_list args;
+
+  va_start(args, request);
+  int result = ftl.do_vioctl (request, args);
+  va_end(args);
+  return result;
+}
+
+static void
+fill (uint8_t* buff, uint32_t value)
+{
+  for (size_t i = 0; i < BLOCK / 4; i++)
+    {
+      uint32_t v = value + i;
+      memcpy (buff + 4 * i, &v, 4);
+    }
+}
+
+static int
+verify (qspi_ftl& ftl, const std::vector<uint32_t>& model)
+{
+  uint8_t buff[BLOCK], expected[BLOCK];
+  int errors = 0;
+
+  for (size_t b = 0; b < model.size (); b++)
+    {
+      if (model[b] == 0)
+        {
+          memset (expected, 0xFF, BLOCK);
+        }
+      else
+        {
+          fill (expected, model[b]);
+        }
+      if (ftl.do_read_block (buff, b, 1) != 1
+          || memcmp (buff, expected, BLOCK) != 0)
+        {
+          errors++;
+        }
+    }
+
+  return errors;
+}
+
+static int
+run (bool can_suspend)
+{
+  qspi_impl* flash;
+  qspi_ftl* ftl;
+  uint8_t buff[BLOCK];
+  int errors = 0;
+
+  flash = new qspi_impl (can_suspend);
+  ftl = new qspi_ftl (*flash, 4);
+  if (open_ftl (*ftl) != 0)
+    {
+      printf ("Open failed\n");
+      return 1;
+    }
+
+  size_t blocks = (qspi_impl::SECTORS - 4) * 7;
+  std::vector<uint32_t> model (blocks, 0);
+
+  srand (0xBABA);
+  for (int n = 1; n <= WRITES && errors == 0; n++)
+    {
+      // 80% of the writes go to a hot set of 20 blocks, the others to the
+      // first half of the device (the rest stays unwritten)
+      size_t b = (rand () % 10 < 8) ? rand () % 20 : rand () % (blocks / 2);
+      uint32_t v = (rand () | 1);
+
+      fill (buff, v);
+      if (ftl->do_write_block (buff, b, 1) != 1)
+        {
+          printf ("Write error at %d\n", n);
+          return 1;
+        }
+      model[b] = v;
+
+      // a few collection steps, erases are often left in progress
+      for (int steps = rand () % 6; steps > 0; steps--)
+        {
+          if (ioctl_ftl (*ftl, qspi_ftl::ioctl_gc) < 0)
+            {
+              printf ("Garbage collection error at %d\n", n);
+              return 1;
+            }
+        }
+
+      if (n % REMOUNT == 0)
+        {
+          // power cut, no close
+          delete ftl;
+          flash->power_cut ();
+          ftl = new qspi_ftl (*flash, 4);
+          if (open_ftl (*ftl) != 0)
+            {
+              printf ("Mount failed at %d\n", n);
+              return 1;
+            }
+          if (n == WRITES / 2)
+            {
+              ioctl_ftl (*ftl, qspi_ftl::ioctl_gc_policy,
+                         (int) qspi_ftl::gc_greedy);
+            }
+          errors += verify (*ftl, model);
+        }
+    }
+
+  // clean close and mount
+  if (ftl->do_close () != 0 || open_ftl (*ftl) != 0)
+    {
+      printf ("Close/open failed\n");
+      return 1;
+    }
+  errors += verify (*ftl, model);
+  delete ftl;
+
+  unsigned min = ~0u, max = 0;
+  for (unsigned e : flash->erases)
+    {
+      min = (e < min) ? e : min;
+      max = (e > max) ? e : max;
+    }
+  printf ("%s suspend: %d errors, %u violations, %u suspended programs, "
+          "%u erase waits, erases per sector %u..%u\n",
+          can_suspend ? "With" : "Without", errors, flash->violations,
+          flash->suspends, flash->waits, min, max);
+
+  int result = (errors != 0 || flash->violations != 0
+      || (can_suspend && flash->suspends == 0)) ? 1 : 0;
+  delete flash;
+  return result;
+}
+
+int
+main (void)
+{
+  int result = run (true) | run (false);
+
+  printf ("%s\n", result ? "FAILED" : "Passed");
+  return result;
+}
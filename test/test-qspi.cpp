@@ -114,6 +114,90 @@ HAL_QSPI_TxCpltCallback (QSPI_HandleTypeDef* phqspi)
     }
 }
 
+#if FLASH_LOW_LEVEL_TEST == true
+/**
+ * @brief  Measure the per-operation overhead of small reads and page
+ *    programs, with the commands issued through HAL_QSPI_Command() and
+ *    directly at register level. The page at address 0 is programmed with
+ *    its own content, which leaves the flash unchanged.
+ * @param  buff: a buffer of at least one page.
+ */
+static void
+command_overhead (uint8_t* buff)
+{
+  constexpr int reads = 1000;
+  constexpr int programs = 100;
+  stopwatch sw
+    { };
+
+  for (int direct = 0; direct < 2; direct++)
+    {
+      rtos::clock::timestamp_t read_time, program_time;
+
+      flash.impl ().set_direct_commands (direct != 0);
+
+      sw.start ();
+      for (int i = 0; i < reads; i++)
+        {
+          flash.impl ().read (i * 16, buff, 16);
+        }
+      read_time = sw.stop ();
+
+      flash.impl ().read (0, buff, 256);
+      sw.start ();
+      for (int i = 0; i < programs; i++)
+        {
+          flash.impl ().write (0, buff, 256);
+        }
+      program_time = sw.stop ();
+
+      trace::printf ("%s commands: 16 bytes read %.2f us, "
+                     "page program %.2f us\n",
+                     direct ? "Direct" : "HAL",
+                     read_time / (float) reads,
+                     program_time / (float) programs);
+    }
+}
+
+/**
+ * @brief  Read the first sector into buffers at odd offsets (not cache line
+ *    aligned, with an odd head, the critical case in dual-flash mode) and
+ *    compare with a plain read.
+ * @param  ref: a buffer of one sector, receives the reference data.
+ * @param  buff: a buffer of one sector.
+ * @param  sector_size: the sector size.
+ * @return true if the data matched.
+ */
+static bool
+unaligned_reads (uint8_t* ref, uint8_t* buff, size_t sector_size)
+{
+  static const size_t offsets[] =
+    { 1, 3, 29 };
+
+  if (flash.impl ().read (0, ref, sector_size) != qspi_impl::ok)
+    {
+      return false;
+    }
+  for (size_t offset : offsets)
+    {
+      // even counts, below and above the bounce buffer size
+      for (size_t count : { (size_t) 64, sector_size - 32 })
+        {
+          memset (buff, 0xAA, sector_size);
+          if (flash.impl ().read (0, buff + offset, count) != qspi_impl::ok
+              || memcmp (ref, buff + offset, count) != 0)
+            {
+              trace::printf ("Unaligned read error, offset %d, count %d\n",
+                             offset, count);
+              return false;
+            }
+        }
+    }
+
+  return true;
+}
+#endif
+
 /**
  * @brief  This is a test function that exercises the qspi driver.
  */
@@ -342,6 +426,15 @@ test_qspi (void)
 #endif
             }
 
+          if (j == sector_count && !unaligned_reads (pw, pr, sector_size))
+            {
+              j = 0;
+            }
+          if (j == sector_count)
+            {
+              command_overhead (pr);
+            }
+
           // done, clean-up and exit
           delete (pr);
           delete (pw);